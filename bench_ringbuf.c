@@ -0,0 +1,148 @@
+/************
+ * Throughput of chained in-process pipeline stages
+ * Compares ring buffer hops against kernel pipes for 2 to 8 stages.
+ * gcc -O2 -pthread -o bench_ringbuf bench_ringbuf.c
+ * ./bench_ringbuf [MiB per run]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ringbuf.h"
+
+#define MAX_STAGES 8
+#define CHUNK (64 * 1024)   // bytes moved per read()/write() by every stage
+
+// One stage: copies its input to its output like a `cat` builtin would
+struct stage {
+    int index;
+    int num_stages;
+    size_t total;           // bytes the first stage produces
+    struct ringbuf* in_ring;
+    struct ringbuf* out_ring;
+    int in_fd;
+    int out_fd;
+};
+
+static ssize_t stageRead(struct stage* s, char* buf, size_t len){
+    if(s->in_ring != NULL){
+        return ringRead(s->in_ring, buf, len);
+    }
+    return read(s->in_fd, buf, len);
+}
+
+static int stageWrite(struct stage* s, const char* buf, size_t len){
+    if(s->out_ring != NULL){
+        return ringWrite(s->out_ring, buf, len) < 0 ? -1 : 0;
+    }
+    size_t done = 0;
+    while(done < len){
+        ssize_t n = write(s->out_fd, buf + done, len - done);
+        if(n < 0){
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static void* runStage(void* arg){
+    struct stage* s = arg;
+    char* buf = malloc(CHUNK);
+    memset(buf, 'x', CHUNK);
+
+    if(s->index == 0){
+        // producer
+        for(size_t sent = 0; sent < s->total; sent += CHUNK){
+            stageWrite(s, buf, CHUNK);
+        }
+    }
+    else{
+        ssize_t n;
+        while((n = stageRead(s, buf, CHUNK)) > 0){
+            if(s->index < s->num_stages - 1){
+                stageWrite(s, buf, n);
+            }
+        }
+    }
+
+    if(s->out_ring != NULL){
+        ringCloseWriter(s->out_ring);
+    }
+    else if(s->out_fd >= 0){
+        close(s->out_fd);
+    }
+    if(s->in_ring != NULL){
+        ringCloseReader(s->in_ring);
+    }
+    else if(s->in_fd >= 0){
+        close(s->in_fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Returns MiB/s for one chain of num_stages stages
+static double runChain(int num_stages, size_t total, int use_ring){
+    struct stage stages[MAX_STAGES];
+    pthread_t threads[MAX_STAGES];
+    struct ringbuf* rings[MAX_STAGES] = { NULL };
+    struct timespec start, end;
+
+    for(int i = 0; i < num_stages; i++){
+        stages[i] = (struct stage){ i, num_stages, total, NULL, NULL, -1, -1 };
+    }
+    for(int i = 0; i < num_stages - 1; i++){
+        if(use_ring){
+            rings[i] = ringCreate();
+            stages[i].out_ring = rings[i];
+            stages[i + 1].in_ring = rings[i];
+        }
+        else{
+            int fds[2];
+            if(pipe(fds) < 0){
+                perror("pipe");
+                exit(EXIT_FAILURE);
+            }
+            stages[i].out_fd = fds[1];
+            stages[i + 1].in_fd = fds[0];
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < num_stages; i++){
+        pthread_create(&threads[i], NULL, runStage, &stages[i]);
+    }
+    for(int i = 0; i < num_stages; i++){
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for(int i = 0; i < num_stages - 1; i++){
+        if(rings[i] != NULL){
+            ringDestroy(rings[i]);
+        }
+    }
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return total / (1024.0 * 1024.0) / secs;
+}
+
+int main(int argc, char** argv){
+    size_t mib = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1024;
+    size_t total = mib * 1024 * 1024;
+
+    printf("%-7s %12s %12s %8s\n", "stages", "pipe MiB/s", "ring MiB/s", "speedup");
+    for(int n = 2; n <= MAX_STAGES; n++){
+        double pipe_rate = runChain(n, total, 0);
+        double ring_rate = runChain(n, total, 1);
+        printf("%-7d %12.0f %12.0f %7.2fx\n", n, pipe_rate, ring_rate, ring_rate / pipe_rate);
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+/************
+ * Custom Bash Shell - embedding API (libmyshell)
+ * Runs command lines through the shell's parser and executor in-process.
+ * gcc -DMSH_LIBRARY -fvisibility=hidden -shared -fPIC -pthread -o libmyshell.so myshell_v2.c -ldl
+ *
+ * The shell keeps one state per process (cwd, variables, functions, aliases),
+ * contexts share it and msh_run() calls are serialized.
+ */
+
+#ifndef MYSHELL_H
+#define MYSHELL_H
+
+#include <stddef.h>
+#include <sys/time.h>
+#include <sys/resource.h>   // struct rusage
+
+#define MSH_API __attribute__((visibility("default")))
+
+#define MSH_MAX_STATUSES 8  // MAX_PROCS, commands of one pipeline or && group
+
+// msh_create() flags
+#define MSH_CAPTURE_OUT 1   // collect stdout into msh_result.out
+#define MSH_CAPTURE_ERR 2   // collect stderr into msh_result.err
+
+struct msh_ctx;
+
+struct msh_result {
+    int status;                         // $? of the command line
+    int num_statuses;
+    int statuses[MSH_MAX_STATUSES];     // every command of the last pipeline or && group
+    struct rusage rusage;               // of the children reaped during the run
+    char* out;                          // NUL terminated, NULL when not captured
+    size_t out_len;
+    char* err;
+    size_t err_len;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Ignores SIGPIPE for the process: builtin pipeline stages run as threads
+MSH_API struct msh_ctx* msh_create(int flags);
+MSH_API void msh_destroy(struct msh_ctx* ctx);
+
+// Run one command line, e.g. "a | b". Returns 0 once it ran (whatever its
+// exit status), -1 when the output could not be captured
+MSH_API int msh_run(struct msh_ctx* ctx, const char* line, struct msh_result* result);
+MSH_API void msh_result_free(struct msh_result* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+/************
+ * Custom Bash Shell - loadable builtin ABI
+ * A shared object loaded with `enable -f libfoo.so foo` must export
+ * a `struct msh_builtin` named `foo_builtin`.
+ */
+
+#ifndef MYSHELL_BUILTIN_H
+#define MYSHELL_BUILTIN_H
+
+#include <sys/types.h>  // ssize_t, size_t
+
+// Bumped whenever struct msh_io or struct msh_builtin change layout
+#define MSH_BUILTIN_ABI 1
+
+// The streams and environment handed to a builtin for one invocation.
+// Builtins should do their stdin/stdout I/O through read() and write(),
+// in_fd / out_fd are -1 when the stream is not backed by a file descriptor
+struct msh_io {
+    int in_fd;
+    int out_fd;
+    int err_fd;
+
+    ssize_t (*read)(struct msh_io* io, void* buf, size_t len);          // 0 on end of input
+    ssize_t (*write)(struct msh_io* io, const void* buf, size_t len);   // writes all of buf or fails
+
+    const char* (*getenv)(const char* name);
+    int (*setenv)(const char* name, const char* value);  // value NULL unsets
+
+    void* priv;     // owned by the shell, do not touch
+};
+
+// argv[0] is the builtin name, argv[argc] is NULL.
+// Returns the exit status of the builtin (0 on success)
+typedef int (*msh_builtin_fn)(int argc, char** argv, struct msh_io* io);
+
+struct msh_builtin {
+    int abi;            // must be MSH_BUILTIN_ABI
+    const char* name;
+    msh_builtin_fn fn;
+    const char* usage;  // one line shown by `enable`
+};
+
+#endif
@@ -0,0 +1,155 @@
+/************
+ * Custom Bash Shell - daemon client
+ * Runs a command line in a warm `myshell --daemon` instead of starting a shell.
+ * myshell_client [-s socket] command line...
+ * The socket defaults to $MSH_SOCKET. Exits with the command line's status.
+ * $MSH_DAEMON_TOKEN is sent first when set.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "myshell_proto.h"
+
+extern char** environ;
+
+// Append a NUL terminated string to the payload
+static void addString(char** buf, size_t* len, size_t* cap, const char* str){
+    size_t n = strlen(str) + 1;
+    if(*len + n > *cap){
+        *cap = (*len + n) * 2;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, str, n);
+    *len += n;
+}
+
+static int readFull(int fd, void* buf, size_t len){
+    size_t done = 0;
+    while(done < len){
+        ssize_t n = read(fd, (char*)buf + done, len - done);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv){
+    const char* sock_path = getenv("MSH_SOCKET");
+    int first = 1;
+
+    if(argc > 2 && strcmp(argv[1], "-s") == 0){
+        sock_path = argv[2];
+        first = 3;
+    }
+    if(sock_path == NULL || first >= argc){
+        fprintf(stderr, "usage: myshell_client [-s socket] command line...\n");
+        return 2;
+    }
+
+    // payload: cwd, command line, environment
+    char* payload = NULL;
+    size_t len = 0, cap = 0;
+    char cwd[4096];
+    if(getcwd(cwd, sizeof(cwd)) == NULL){
+        perror("getcwd");
+        return 1;
+    }
+    addString(&payload, &len, &cap, cwd);
+
+    size_t line_len = 0;
+    for(int i = first; i < argc; i++){
+        line_len += strlen(argv[i]) + 1;
+    }
+    char* line = malloc(line_len + 1);
+    line[0] = '\0';
+    for(int i = first; i < argc; i++){
+        if(i > first){
+            strcat(line, " ");
+        }
+        strcat(line, argv[i]);
+    }
+    addString(&payload, &len, &cap, line);
+
+    for(char** env = environ; *env != NULL; env++){
+        addString(&payload, &len, &cap, *env);
+    }
+    if(len > MSH_MAX_PAYLOAD){
+        fprintf(stderr, "myshell_client: environment too large\n");
+        return 1;
+    }
+
+    // a daemon that rejects us closes the socket, report it instead of dying
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+        perror(sock_path);
+        return 1;
+    }
+
+    // a daemon with a token wants it before anything else
+    const char* token = getenv("MSH_DAEMON_TOKEN");
+    if(token != NULL && *token != '\0'){
+        struct msh_msg_hdr auth = { MSH_PROTO_MAGIC, MSH_MSG_AUTH, (uint32_t)strlen(token) };
+        if(write(sock, &auth, sizeof(auth)) != sizeof(auth) || write(sock, token, auth.len) != (ssize_t)auth.len){
+            perror("write");
+            return 1;
+        }
+    }
+
+    // our stdin, stdout and stderr go along with the header
+    struct msh_msg_hdr hdr = { MSH_PROTO_MAGIC, MSH_MSG_RUN, (uint32_t)len };
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if(sendmsg(sock, &msg, 0) != sizeof(hdr)){
+        perror("sendmsg");
+        return 1;
+    }
+    for(size_t done = 0; done < len; ){
+        ssize_t n = write(sock, payload + done, len - done);
+        if(n < 0){
+            perror("write");
+            return 1;
+        }
+        done += n;
+    }
+
+    // wait for the exit status
+    int32_t status;
+    if(readFull(sock, &hdr, sizeof(hdr)) < 0 || hdr.magic != MSH_PROTO_MAGIC ||
+       hdr.type != MSH_MSG_EXIT || hdr.len != sizeof(status) || readFull(sock, &status, sizeof(status)) < 0){
+        fprintf(stderr, "myshell_client: daemon closed the connection\n");
+        return 1;
+    }
+    return status;
+}
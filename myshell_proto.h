@@ -0,0 +1,42 @@
+/************
+ * Custom Bash Shell - daemon protocol
+ * Shared by `myshell --daemon` and myshell_client.
+ * Every message is a struct msh_msg_hdr followed by len payload bytes.
+ */
+
+#ifndef MYSHELL_PROTO_H
+#define MYSHELL_PROTO_H
+
+#include <stdint.h>
+
+#define MSH_PROTO_MAGIC 0x4d534831u     // "MSH1"
+#define MSH_MAX_PAYLOAD (1 << 20)       // cwd + command line + environment
+
+// client -> daemon, first message of every session when the daemon has a token
+// MSH_MSG_AUTH payload: the shared secret, $MSH_DAEMON_TOKEN on both sides
+#define MSH_MSG_AUTH 6
+
+// client -> daemon
+// MSH_MSG_RUN payload: "cwd\0command line\0NAME=value\0NAME=value\0..."
+// carries the client's stdin, stdout and stderr as SCM_RIGHTS fds
+#define MSH_MSG_RUN 1
+
+// scheduler -> daemon, a job of a distributed && group
+// MSH_MSG_JOB payload: same as MSH_MSG_RUN, but no fds: stdin is /dev/null and
+// the output comes back as MSH_MSG_OUT / MSH_MSG_ERR frames before MSH_MSG_EXIT
+#define MSH_MSG_JOB 3
+
+// daemon -> client
+// MSH_MSG_EXIT payload: int32_t exit status of the command line
+#define MSH_MSG_EXIT 2
+// MSH_MSG_OUT / MSH_MSG_ERR payload: bytes the job wrote to stdout / stderr
+#define MSH_MSG_OUT 4
+#define MSH_MSG_ERR 5
+
+struct msh_msg_hdr {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t len;
+};
+
+#endif
@@ -0,0 +1,48 @@
+/************
+ * Custom Bash Shell - stdio buffering shim for external commands
+ * Preloaded by the shell when MSH_STDBUF is set, see execArgs().
+ * MSH_STDBUF_I / _O / _E hold "0" (unbuffered), "L" (line buffered)
+ * or a buffer size in bytes for stdin / stdout / stderr.
+ * gcc -shared -fPIC -o libmyshell_stdbuf.so myshell_stdbuf.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void setBuffering(FILE* stream, int fd, const char* name){
+    const char* mode = getenv(name);
+    if(mode == NULL || *mode == '\0'){
+        return;
+    }
+    // a program talking to a terminal keeps its own buffering
+    if(isatty(fd)){
+        return;
+    }
+
+    if(mode[0] == 'L' && mode[1] == '\0'){
+        setvbuf(stream, NULL, _IOLBF, 0);
+        return;
+    }
+    char* end;
+    unsigned long size = strtoul(mode, &end, 10);
+    if(*end != '\0'){
+        return;
+    }
+    if(size == 0){
+        setvbuf(stream, NULL, _IONBF, 0);
+        return;
+    }
+    // glibc ignores the size unless it is given the buffer, kept until exit
+    char* buf = malloc(size);
+    if(buf != NULL && setvbuf(stream, buf, _IOFBF, size) != 0){
+        free(buf);
+    }
+}
+
+__attribute__((constructor))
+static void initBuffering(void){
+    setBuffering(stdin, STDIN_FILENO, "MSH_STDBUF_I");
+    setBuffering(stdout, STDOUT_FILENO, "MSH_STDBUF_O");
+    setBuffering(stderr, STDERR_FILENO, "MSH_STDBUF_E");
+}
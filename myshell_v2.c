@@ -4,6 +4,8 @@
  * Shaan
  */
 
+#define _GNU_SOURCE     // pipe2(), splice() and friends
+
 #include <stdio.h>      // standard library for i/o operations
 #include <string.h>     // for string manipulation - strstep(), etc
 #include <stdlib.h>     // exit() 
@@ -12,286 +14,5465 @@
 #include <signal.h>     // signal()
 #include <fcntl.h>      // close(), open()
 #include <ctype.h>
+#include <errno.h>
+#include <dlfcn.h>      // dlopen(), dlsym() for loadable builtins and codecs
+#include <pthread.h>    // builtin pipeline stages run as threads
+#include <dirent.h>     // opendir() for hashing PATH
+#include <sys/stat.h>
+#include <sys/socket.h> // daemon mode
+#include <sys/un.h>
+#include <sys/mman.h>   // memfd_create() for captured output
+#include <sys/resource.h>
+#include <sys/file.h>   // flock() on the job stats and memo files
+#include <inttypes.h>
+#include <sys/syscall.h>    // pidfd_open()
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>          // tcp: workers
+#include <netinet/in.h>
+#if __has_include(<zlib.h>)
+#include <zlib.h>           // types only, libz is loaded for >gz when needed
+#define HAVE_ZLIB 1
+#endif
+
+#include "myshell_builtin.h"
+#include "ringbuf.h"        // builtin to builtin pipeline hops
+#include "myshell_proto.h"  // daemon mode
+#include "myshell.h"        // embedding API
 
 // Since C only supports fixed sized arrays in statc allocation
 #define MAX_PROCS 8     // max processes that can run parallely
-#define MAX_ARGS 10      // max arguments per command including tags and options
+#define MAX_ARGS 32      // max arguments per command including tags and options
+#define MAX_BUILTINS 64 // max builtins, compiled in and loaded with enable -f
+#define HASH_BUCKETS 256    // buckets of the name -> value tables
+#define MAX_FUNC_DEPTH 256  // max nesting of shell function calls
+#define MAX_ALIAS_DEPTH 16  // max aliases expanded into one another for a command
+#define MAX_POOL_WORKERS 64 // max warm instances behind one pool / coproc
+#define LINE_BUF 65536      // read buffer of a line reader
+#define MAX_WORKERS 16      // executors of the parallel scheduler, local one included
 
 // Function prototypes
 void parseInput(char* input_str, char** args);
 void executeCommand(char** args);
 void executeParallelCommands(char* input_str);
 void executeSequentialCommands(char* input_str);
+void executeParallelSteps(char* input_str, int slots);
+static int listChangesState(const char* list);
+static long long parseSize(const char* text);
 void executeCommandRedirection(char* input_str);
 void executePipeCommands(char* input_str); 
+void executeLine(char* line);
+void executeGroup(char* line);
+void exitChild(int status);
+void* runPipeStage(void* stage);
 char* trimStr(char* input_str);  // String utility function
+char* expandVars(const char* text);
+int isExitCommand(const char* line);
+void runInput(char* line);
+
+// Daemon mode
+int runDaemon(const char* addr);
+int sendMsg(int sock, uint32_t type, const void* payload, uint32_t len);
+int recvMsg(int sock, struct msh_msg_hdr* hdr, char** payload, int* fds, int max_fds, int* num_fds);
+
+// Builtins
+struct msh_builtin* lookupBuiltin(const char* name);
+int callBuiltin(struct msh_builtin* builtin, char** args, struct msh_io* io);
+int runBuiltin(struct msh_builtin* builtin, char** args, int in_fd, int out_fd);
+void execArgs(char** args);
+int builtinCd(int argc, char** argv, struct msh_io* io);
+int builtinEnable(int argc, char** argv, struct msh_io* io);
+int builtinRead(int argc, char** argv, struct msh_io* io);
+int builtinAlias(int argc, char** argv, struct msh_io* io);
+int builtinUnalias(int argc, char** argv, struct msh_io* io);
+int builtinPool(int argc, char** argv, struct msh_io* io);
+int builtinCoproc(int argc, char** argv, struct msh_io* io);
+
+// A builtin stage of a pipeline, run on its own thread.
+// A hop between two builtin stages is a ring buffer instead of a pipe
+struct pipeStage {
+    struct msh_builtin* builtin;
+    char** args;
+    int in_fd;
+    int out_fd;
+    struct ringbuf* in_ring;
+    struct ringbuf* out_ring;
+    int status;
+    pthread_t thread;
+};
+
+// Builtin table, checked before any command is forked
+struct msh_builtin builtin_cd = { MSH_BUILTIN_ABI, "cd", builtinCd, "cd dir" };
+struct msh_builtin builtin_enable = { MSH_BUILTIN_ABI, "enable", builtinEnable, "enable [-f file.so name...]" };
+struct msh_builtin builtin_read = { MSH_BUILTIN_ABI, "read", builtinRead, "read [name...]" };
+struct msh_builtin builtin_alias = { MSH_BUILTIN_ABI, "alias", builtinAlias, "alias [name=value]" };
+struct msh_builtin builtin_unalias = { MSH_BUILTIN_ABI, "unalias", builtinUnalias, "unalias name..." };
+struct msh_builtin builtin_pool = { MSH_BUILTIN_ABI, "pool", builtinPool, "pool -s name N cmd... | pool -k name | pool name" };
+struct msh_builtin builtin_coproc = { MSH_BUILTIN_ABI, "coproc", builtinCoproc, "coproc name [cmd...]" };
+int builtinHash(int argc, char** argv, struct msh_io* io);
+struct msh_builtin builtin_hash = { MSH_BUILTIN_ABI, "hash", builtinHash, "hash [-r]" };
+int builtinBatch(int argc, char** argv, struct msh_io* io);
+struct msh_builtin builtin_batch = { MSH_BUILTIN_ABI, "batch", builtinBatch, "batch [-j N] [-r] [--results DIR] [--progress[=HZ]] jobfile" };
+int builtinMemo(int argc, char** argv, struct msh_io* io);
+struct msh_builtin builtin_memo = { MSH_BUILTIN_ABI, "memo", builtinMemo, "memo [--in file...] [--out file...] -- cmd..." };
+int builtinCache(int argc, char** argv, struct msh_io* io);
+struct msh_builtin builtin_cache = { MSH_BUILTIN_ABI, "cache", builtinCache, "cache [-e NAME]... -- cmd..." };
+int builtinPv(int argc, char** argv, struct msh_io* io);
+struct msh_builtin builtin_pv = { MSH_BUILTIN_ABI, "pv", builtinPv, "pv [-L RATE] [-i SECS] [-N NAME]" };
+
+struct msh_builtin* builtins[MAX_BUILTINS] = { &builtin_cd, &builtin_enable, &builtin_read, &builtin_alias, &builtin_unalias,
+                                               &builtin_pool, &builtin_coproc, &builtin_hash, &builtin_batch, &builtin_memo,
+                                               &builtin_cache, &builtin_pv };
+int num_builtins = 12;
+
+// Chained hash table keyed by name
+struct hashEntry {
+    char* key;
+    void* value;
+    struct hashEntry* next;
+};
+
+struct hashTable {
+    struct hashEntry* buckets[HASH_BUCKETS];
+};
+
+// Growable string
+struct strBuf {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+void bufAppend(struct strBuf* buf, const char* str, size_t len);
+
+unsigned long hashStr(const char* str);
+void* hashGet(struct hashTable* table, const char* key);
+void* hashPut(struct hashTable* table, const char* key, void* value);
+void* hashRemove(struct hashTable* table, const char* key);
+
+// Shell functions: name() { list; }
+// The body is split into statements once at definition time, simple commands
+// are also tokenized so a call only substitutes $1.. and runs them
+struct funcStmt {
+    char* text;             // statement, run through executeLine when compound
+    char* args[MAX_ARGS];   // tokens of a simple command, args[0] NULL when compound
+    char* words;            // storage args point into, aliases may be dropped later
+    int expand;             // has a $ to substitute on every call
+};
+
+struct shellFunc {
+    char* body;             // storage the statements point into
+    int num_stmts;
+    struct funcStmt* stmts;
+};
+
+// Positional parameters of the functions being run, innermost last
+struct funcFrame {
+    int argc;
+    char** argv;
+};
+
+struct hashTable functions;
+struct funcFrame func_frames[MAX_FUNC_DEPTH];
+int func_depth = 0;
+
+int defineFunction(char* line);
+void callFunction(struct shellFunc* func, char** args);
+
+// Aliases, the value is tokenized when defined so the lexer only swaps pointers
+struct alias {
+    char* value;            // as given, for listing
+    char* words;            // storage args point into
+    int argc;
+    char* args[MAX_ARGS];
+};
+
+struct hashTable aliases;
+int num_aliases = 0;
+
+// Buffered line reader over a builtin's input or a plain fd
+struct lineReader {
+    struct msh_io* io;      // NULL to read fd directly
+    int fd;
+    char buf[LINE_BUF];
+    size_t start;
+    size_t end;
+};
+
+int readLine(struct lineReader* reader, struct strBuf* line);
+
+// Warm long-lived instances of a command fed one line per request,
+// a coproc is a pool with a single worker
+struct poolWorker {
+    pid_t pid;
+    int to_fd;              // worker's stdin
+    struct lineReader from; // worker's stdout
+    int busy;
+    struct strBuf request;  // line in flight, sent again to a replacement
+    int retried;            // the request already got a replacement
+};
+
+struct workerPool {
+    int size;
+    pthread_mutex_t lock;   // one routing builtin at a time
+    char* args[MAX_ARGS];   // command, to replace workers that die
+    char* pid_var;          // a coproc's name_PID, kept naming the live worker
+    int routers;            // routing builtins holding the pool, under pools_lock
+    int stopped;            // pool -k ran, the last router stops it
+    struct poolWorker workers[];
+};
+
+struct hashTable pools;
+pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;    // pipeline stages start and stop pools
+
+// Parallel scheduler.
+// Every executor (the shell itself, or a myshell daemon) has a deque of jobs:
+// it takes work from the head of its own, and when that runs dry it steals
+// half of the busiest executor's queue from the tail
+enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_SKIPPED };
+
+struct job {
+    char* cmd;              // command line
+    int index;              // position in the input
+    int state;
+    int status;             // exit status once JOB_DONE
+    int worker;             // executor it runs on
+    pid_t pid;              // local job
+    int fd;                 // pidfd of a local job, connection of a remote one
+    int out_fd;             // where its stdout / stderr go, -1 for the shell's own
+    int err_fd;
+    double expected;        // seconds it took on earlier runs, for the launch order
+    struct timespec start;
+    struct timespec end;
+
+    // dependencies, "job name: deps -- cmd" lines of a job file
+    char* name;
+    int pending;            // dependencies that haven't succeeded yet
+    int* dependents;
+    int num_dependents;
+    int released_by;        // the dependency that finished last, -1 for a root
+};
+
+struct worker {
+    char* addr;             // NULL for the shell itself, else unix:PATH or tcp:HOST:PORT
+    int slots;              // jobs it runs at once, 0 once it is unreachable
+    int running;
+    int* queue;             // circular deque of job indices
+    int head;
+    int count;
+};
+
+struct scheduler {
+    struct job* jobs;
+    int num_jobs;
+    int num_done;           // finished or skipped
+    struct worker workers[MAX_WORKERS];
+    int num_workers;
+
+    int keep_going;         // dependents run even when a dependency failed
+    int progress_ms;        // status line on stderr at most this often, 0 for none
+    struct timespec began;
+    struct timespec drawn;  // last status line
+
+    // optional hooks
+    int (*claim)(struct scheduler* sched, struct job* job);       // 0: someone else runs it
+    void (*starting)(struct scheduler* sched, struct job* job);
+    void (*finished)(struct scheduler* sched, struct job* job);
+    void* data;
+};
+
+void initScheduler(struct scheduler* sched, struct job* jobs, int num_jobs, int local_slots);
+void runScheduler(struct scheduler* sched);
+void freeScheduler(struct scheduler* sched);
+static void finishJob(struct scheduler* sched, struct job* job, int status);
+
+// Exit status of the last command, $?
+int last_status = 0;
+
+// Where a child reports a command it can't exec, a pool worker's stdout carries replies
+int exec_error_fd = STDOUT_FILENO;
+
+// Status of every command of the last pipeline or && group
+_Static_assert(MSH_MAX_STATUSES >= MAX_PROCS, "msh_result.statuses must hold a whole pipeline");
+int stage_statuses[MAX_PROCS];
+int num_stage_statuses = 0;
+
+int statusOf(int wait_status);
+
+// Resolved PATH lookups, so a warm shell execs without searching PATH again
+struct hashTable command_paths;
+char* command_paths_for = NULL;     // PATH the cache was filled for
+
+const char* resolveCommand(const char* name);
+int connectAddr(const char* addr);
+void hashAllCommands(void);
+
+// Replace the command word args[0] by its alias, and again while the first
+// word of the result is an alias not used yet. Returns the number of words
+static int expandAlias(char** args){
+    struct alias* seen[MAX_ALIAS_DEPTH];
+    int num_seen = 0;
+    int argc = 1;
+    struct alias* alias;
+
+    while(num_seen < MAX_ALIAS_DEPTH && (alias = hashGet(&aliases, args[0])) != NULL){
+        // `alias ls='ls -F'` must not expand ls forever
+        for(int i = 0; i < num_seen; i++){
+            if(seen[i] == alias){
+                return argc;
+            }
+        }
+        seen[num_seen++] = alias;
+
+        // alias words take the place of args[0], the rest shifts right
+        int tail = argc - 1;
+        if(alias->argc + tail > MAX_ARGS - 2){
+            tail = MAX_ARGS - 2 - alias->argc;
+        }
+        memmove(&args[alias->argc], &args[1], tail * sizeof(char*));
+        memcpy(args, alias->args, alias->argc * sizeof(char*));
+        argc = alias->argc + tail;
+        if(argc == 0){
+            break;  // empty alias
+        }
+    }
+    return argc;
+}
+
+// Parse the input string and seperate cmd, tags, options, args for execvp 
+void parseInput(char* input_str, char** args){
+    int i = 0;
+    // seperates string on empty space
+    while(i < MAX_ARGS - 1 && (args[i] = strsep(&input_str, " ")) != NULL){
+        if(*args[i] != '\0'){   // token should not be a terminating char
+            // the command word is looked up in the alias table as soon as it is lexed
+            if(i == 0 && num_aliases > 0){
+                i = expandAlias(args);
+            }
+            else{
+                i++;
+            }
+        }
+    }
+    // execvp needs last char to be a NULL to indicate end of args
+    args[i] = NULL;
+}
+
+// Find a builtin by name, NULL if the command has to be exec'd
+struct msh_builtin* lookupBuiltin(const char* name){
+    for(int i = 0; i < num_builtins; i++){
+        if(strcmp(builtins[i]->name, name) == 0){
+            return builtins[i];
+        }
+    }
+    return NULL;
+}
+
+// msh_io stream callbacks for builtins running on plain file descriptors
+static ssize_t fdRead(struct msh_io* io, void* buf, size_t len){
+    ssize_t n;
+    do{
+        n = read(io->in_fd, buf, len);
+    } while(n < 0 && errno == EINTR);
+    return n;
+}
+
+static ssize_t fdWrite(struct msh_io* io, const void* buf, size_t len){
+    size_t done = 0;
+    while(done < len){
+        ssize_t n = write(io->out_fd, (const char*)buf + done, len - done);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static const char* envGet(const char* name){
+    return getenv(name);
+}
+
+static int envSet(const char* name, const char* value){
+    if(value == NULL){
+        return unsetenv(name);
+    }
+    return setenv(name, value, 1);
+}
+
+// msh_io stream callbacks for pipeline stages connected by ring buffers
+static ssize_t ringIoRead(struct msh_io* io, void* buf, size_t len){
+    struct pipeStage* stage = io->priv;
+    return ringRead(stage->in_ring, buf, len);
+}
+
+static ssize_t ringIoWrite(struct msh_io* io, const void* buf, size_t len){
+    struct pipeStage* stage = io->priv;
+    return ringWrite(stage->out_ring, buf, len);
+}
+
+// Call a builtin with an already set up msh_io
+int callBuiltin(struct msh_builtin* builtin, char** args, struct msh_io* io){
+    int argc = 0;
+    while(args[argc] != NULL){
+        argc++;
+    }
+
+    fflush(stdout);     // keep the shell's own buffered output ahead of the builtin's
+    return builtin->fn(argc, args, io);
+}
+
+// Run a builtin in the current process with the given stdin/stdout
+int runBuiltin(struct msh_builtin* builtin, char** args, int in_fd, int out_fd){
+    struct msh_io io = { in_fd, out_fd, STDERR_FILENO, fdRead, fdWrite, envGet, envSet, NULL };
+    return callBuiltin(builtin, args, &io);
+}
+
+// MSH_STDBUF=o=1M,e=L,i=0 sets the stdio buffering (size, L for lines, 0 for
+// none) of external commands writing to pipes or files. It is done by the
+// LD_PRELOAD shim built from myshell_stdbuf.c, $MSH_STDBUF_LIB or else
+// libmyshell_stdbuf.so next to the shell. The shell resolves it, and warns
+// once when it is missing, whenever either variable changes
+char stdbuf_lib[4096];          // empty: buffering is left alone
+char* stdbuf_for = NULL;        // "MSH_STDBUF\nMSH_STDBUF_LIB" it was resolved for
+
+static void checkStdbuf(void){
+    const char* spec = getenv("MSH_STDBUF");
+    const char* path = getenv("MSH_STDBUF_LIB");
+    struct strBuf key = { NULL, 0, 0 };
+    bufAppend(&key, spec != NULL ? spec : "", spec != NULL ? strlen(spec) : 0);
+    bufAppend(&key, "\n", 1);
+    bufAppend(&key, path != NULL ? path : "", path != NULL ? strlen(path) : 0);
+    if(stdbuf_for != NULL && strcmp(stdbuf_for, key.data) == 0){
+        free(key.data);
+        return;
+    }
+    free(stdbuf_for);
+    stdbuf_for = key.data;
+    stdbuf_lib[0] = '\0';
+    if(spec == NULL || *spec == '\0'){
+        return;
+    }
+
+    char lib[4096];
+    if(path == NULL){
+        ssize_t len = readlink("/proc/self/exe", lib, sizeof(lib) - 32);
+        if(len < 0){
+            len = 0;
+        }
+        lib[len] = '\0';
+        char* slash = strrchr(lib, '/');
+        strcpy((slash != NULL) ? slash + 1 : lib, "libmyshell_stdbuf.so");
+        path = lib;
+    }
+    if(access(path, R_OK) != 0 || strlen(path) >= sizeof(stdbuf_lib)){
+        dprintf(STDERR_FILENO, "Shell: MSH_STDBUF: %s not found, buffering unchanged\n", path);
+        return;
+    }
+    strcpy(stdbuf_lib, path);
+}
+
+// Called in the child right before exec
+static void setChildBuffering(void){
+    const char* spec = getenv("MSH_STDBUF");
+    if(spec == NULL || *spec == '\0' || stdbuf_lib[0] == '\0'){
+        return;
+    }
+
+    char* copy = strdup(spec);
+    char* rest = copy;
+    char* item;
+    while((item = strsep(&rest, ",")) != NULL){
+        const char* name = (item[0] == 'i') ? "MSH_STDBUF_I" : (item[0] == 'o') ? "MSH_STDBUF_O"
+                         : (item[0] == 'e') ? "MSH_STDBUF_E" : NULL;
+        if(name == NULL || item[1] != '='){
+            continue;
+        }
+        char size[32];
+        long long bytes = parseSize(item + 2);
+        if(strcmp(item + 2, "L") == 0){
+            setenv(name, "L", 1);
+        }
+        else if(bytes >= 0){
+            snprintf(size, sizeof(size), "%lld", bytes);
+            setenv(name, size, 1);
+        }
+    }
+    free(copy);
+
+    const char* preload = getenv("LD_PRELOAD");
+    struct strBuf value = { NULL, 0, 0 };
+    bufAppend(&value, stdbuf_lib, strlen(stdbuf_lib));
+    if(preload != NULL && *preload != '\0'){
+        bufAppend(&value, ":", 1);
+        bufAppend(&value, preload, strlen(preload));
+    }
+    setenv("LD_PRELOAD", value.data, 1);
+    free(value.data);
+}
+
+// End a forked child that didn't exec. exit() would flush the stdin it shares
+// with the shell and seek a script back to the shell's position, to be read twice
+void exitChild(int status){
+    fflush(stdout);
+    _exit(status);
+}
+
+// Replace a forked child with the command, builtins run and exit in the child
+void execArgs(char** args){
+    struct shellFunc* func = hashGet(&functions, args[0]);
+    if(func != NULL){
+        callFunction(func, args);
+        exitChild(last_status);
+    }
+
+    struct msh_builtin* builtin = lookupBuiltin(args[0]);
+    if(builtin != NULL){
+        exitChild(runBuiltin(builtin, args, STDIN_FILENO, STDOUT_FILENO));
+    }
+
+    signal(SIGPIPE, SIG_DFL);   // the shell ignores it for its builtin threads
+    setChildBuffering();
+
+    // the cached path may be stale, execvp() then searches PATH itself
+    const char* path = resolveCommand(args[0]);
+    if(path != NULL){
+        execv(path, args);
+    }
+    if(execvp(args[0], args) < 0){
+        dprintf(exec_error_fd, "Shell: Incorrect command\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// cd is not handled by execvp() hence it is done using chdir()
+int builtinCd(int argc, char** argv, struct msh_io* io){
+    (void)io;
+    if(argc < 2 || chdir(argv[1]) != 0){
+        printf("Shell: Incorrect command\n");
+        return 1;
+    }
+    return 0;
+}
+
+// enable                     lists the builtins
+// enable -f file.so name...  loads name_builtin from a shared object
+int builtinEnable(int argc, char** argv, struct msh_io* io){
+    char line[256];
+
+    if(argc == 1){
+        for(int i = 0; i < num_builtins; i++){
+            int len = snprintf(line, sizeof(line), "enable %s\t%s\n", builtins[i]->name, builtins[i]->usage);
+            io->write(io, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+        }
+        return 0;
+    }
+
+    if(argc < 4 || strcmp(argv[1], "-f") != 0){
+        printf("Shell: Incorrect command\n");
+        return 2;
+    }
+
+    // RTLD_LOCAL so two objects can export helpers with the same name
+    void* handle = dlopen(argv[2], RTLD_NOW | RTLD_LOCAL);
+    if(handle == NULL){
+        printf("Shell: %s\n", dlerror());
+        return 1;
+    }
+
+    int status = 0;
+    for(int i = 3; i < argc; i++){
+        snprintf(line, sizeof(line), "%s_builtin", argv[i]);
+        struct msh_builtin* builtin = dlsym(handle, line);
+
+        if(builtin == NULL || builtin->abi != MSH_BUILTIN_ABI || builtin->fn == NULL){
+            printf("Shell: %s: no compatible builtin %s\n", argv[2], argv[i]);
+            status = 1;
+            continue;
+        }
+
+        // a loaded builtin replaces an existing one with the same name
+        int slot;
+        for(slot = 0; slot < num_builtins; slot++){
+            if(strcmp(builtins[slot]->name, argv[i]) == 0){
+                break;
+            }
+        }
+        if(slot == MAX_BUILTINS){
+            printf("Shell: too many builtins\n");
+            status = 1;
+            break;
+        }
+        builtins[slot] = builtin;
+        if(slot == num_builtins){
+            num_builtins++;
+        }
+    }
+
+    // the handle is never closed, loaded builtins live for the whole session
+    return status;
+}
+
+// read [name...]  reads one line and assigns its words to the variables,
+// the last one gets the rest of the line. REPLY when no name is given
+int builtinRead(int argc, char** argv, struct msh_io* io){
+    char line[4096];
+    size_t len = 0;
+    ssize_t n = 0;
+
+    // one byte at a time so nothing past the newline is taken from a shared input
+    while(len < sizeof(line) - 1 && (n = io->read(io, line + len, 1)) > 0){
+        if(line[len] == '\n'){
+            break;
+        }
+        len++;
+    }
+    line[len] = '\0';
+    if(len == 0 && n <= 0){
+        return 1;   // end of input
+    }
+
+    char* rest = line;
+    if(argc < 2){
+        io->setenv("REPLY", rest);
+        return 0;
+    }
+    for(int i = 1; i < argc; i++){
+        while(isspace((unsigned char)*rest)){
+            rest++;
+        }
+        char* word = rest;
+        if(i < argc - 1){
+            while(*rest != '\0' && !isspace((unsigned char)*rest)){
+                rest++;
+            }
+            if(*rest != '\0'){
+                *rest++ = '\0';
+            }
+        }
+        else{
+            word = trimStr(word);
+        }
+        io->setenv(argv[i], word);
+    }
+    return 0;
+}
+
+// alias              lists the aliases
+// alias name=value   defines one, the value may be quoted
+int builtinAlias(int argc, char** argv, struct msh_io* io){
+    if(argc == 1){
+        for(int b = 0; b < HASH_BUCKETS; b++){
+            for(struct hashEntry* entry = aliases.buckets[b]; entry != NULL; entry = entry->next){
+                struct alias* alias = entry->value;
+                char line[512];
+                int len = snprintf(line, sizeof(line), "alias %s='%s'\n", entry->key, alias->value);
+                io->write(io, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+            }
+        }
+        return 0;
+    }
+
+    // the words were split on spaces, put the definition back together
+    struct strBuf def = { NULL, 0, 0 };
+    for(int i = 1; i < argc; i++){
+        if(i > 1){
+            bufAppend(&def, " ", 1);
+        }
+        bufAppend(&def, argv[i], strlen(argv[i]));
+    }
+
+    char* eq = strchr(def.data, '=');
+    if(eq == NULL || eq == def.data){
+        printf("Shell: Incorrect command\n");
+        free(def.data);
+        return 1;
+    }
+    *eq = '\0';
+    char* value = eq + 1;
+    size_t len = strlen(value);
+    if(len >= 2 && (value[0] == '\'' || value[0] == '"') && value[len - 1] == value[0]){
+        value[len - 1] = '\0';
+        value++;
+    }
+
+    struct alias* alias = malloc(sizeof(struct alias));
+    alias->value = strdup(value);
+    alias->words = strdup(value);
+    alias->argc = 0;
+    char* rest = alias->words;
+    char* word;
+    while(alias->argc < MAX_ARGS - 1 && (word = strsep(&rest, " ")) != NULL){
+        if(*word != '\0'){
+            alias->args[alias->argc++] = word;
+        }
+    }
+    alias->args[alias->argc] = NULL;
+
+    struct alias* old = hashPut(&aliases, def.data, alias);
+    if(old != NULL){
+        free(old->value);
+        free(old->words);
+        free(old);
+    }
+    else{
+        num_aliases++;
+    }
+    free(def.data);
+    return 0;
+}
+
+int builtinUnalias(int argc, char** argv, struct msh_io* io){
+    (void)io;
+    int status = 0;
+    for(int i = 1; i < argc; i++){
+        struct alias* alias = hashRemove(&aliases, argv[i]);
+        if(alias == NULL){
+            printf("Shell: unalias: %s: not found\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        free(alias->value);
+        free(alias->words);
+        free(alias);
+        num_aliases--;
+    }
+    return status;
+}
+
+// Read one line without its newline into line. Returns 0 at end of input
+int readLine(struct lineReader* reader, struct strBuf* line){
+    line->len = 0;
+    bufAppend(line, "", 0);
+
+    while(1){
+        if(reader->start == reader->end){
+            ssize_t n;
+            if(reader->io != NULL){
+                n = reader->io->read(reader->io, reader->buf, sizeof(reader->buf));
+            }
+            else{
+                do{
+                    n = read(reader->fd, reader->buf, sizeof(reader->buf));
+                } while(n < 0 && errno == EINTR);
+            }
+            if(n <= 0){
+                return line->len > 0;   // a last line without newline still counts
+            }
+            reader->start = 0;
+            reader->end = n;
+        }
+
+        char* start = reader->buf + reader->start;
+        char* nl = memchr(start, '\n', reader->end - reader->start);
+        if(nl != NULL){
+            bufAppend(line, start, nl - start);
+            reader->start += nl - start + 1;
+            return 1;
+        }
+        bufAppend(line, start, reader->end - reader->start);
+        reader->start = reader->end;
+    }
+}
+
+// Fork worker i of the pool with its stdin/stdout on pipes to the shell.
+// Returns -1 (pid -1) on failure
+static int spawnWorker(struct workerPool* pool, int i){
+    struct poolWorker* worker = &pool->workers[i];
+    int to[2], from[2];
+
+    // close-on-exec so other children don't keep a worker's stdin open
+    if(pipe2(to, O_CLOEXEC) < 0 || pipe2(from, O_CLOEXEC) < 0){
+        printf("Shell: Incorrect command\n");
+        worker->pid = -1;
+        return -1;
+    }
+
+    fflush(stdout);
+    worker->pid = fork();
+    if(worker->pid == 0){
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        dup2(to[0], STDIN_FILENO);
+        dup2(from[1], STDOUT_FILENO);
+        exec_error_fd = STDERR_FILENO;
+        execArgs(pool->args);
+    }
+    close(to[0]);
+    close(from[1]);
+    if(worker->pid < 0){
+        printf("Shell: Incorrect command\n");
+        close(to[1]);
+        close(from[0]);
+        return -1;
+    }
+
+    worker->to_fd = to[1];
+    worker->from.io = NULL;
+    worker->from.fd = from[0];
+    worker->from.start = worker->from.end = 0;
+    return 0;
+}
+
+// Fork size instances of args
+static struct workerPool* startPool(int size, char** args){
+    struct workerPool* pool = calloc(1, sizeof(struct workerPool) + size * sizeof(struct poolWorker));
+    pool->size = size;
+    pthread_mutex_init(&pool->lock, NULL);
+    for(int i = 0; args[i] != NULL && i < MAX_ARGS - 1; i++){
+        pool->args[i] = strdup(args[i]);
+    }
+
+    for(int i = 0; i < size; i++){
+        spawnWorker(pool, i);
+    }
+    return pool;
+}
+
+// Close a worker's pipes and reap it, one that ignores its closed stdin is killed
+static void reapWorker(struct poolWorker* worker){
+    close(worker->to_fd);
+    close(worker->from.fd);
+    if(waitpid(worker->pid, NULL, WNOHANG) == 0){
+        kill(worker->pid, SIGTERM);
+        waitpid(worker->pid, NULL, 0);
+    }
+    worker->pid = -1;
+}
+
+// Close the workers' stdin so they exit, and reap them
+static void stopPool(struct workerPool* pool){
+    for(int i = 0; i < pool->size; i++){
+        if(pool->workers[i].pid > 0){
+            close(pool->workers[i].to_fd);
+            close(pool->workers[i].from.fd);
+        }
+    }
+    for(int i = 0; i < pool->size; i++){
+        if(pool->workers[i].pid > 0){
+            waitpid(pool->workers[i].pid, NULL, 0);
+        }
+        free(pool->workers[i].request.data);
+    }
+    for(int i = 0; pool->args[i] != NULL; i++){
+        free(pool->args[i]);
+    }
+    free(pool->pid_var);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// Start a new worker in slot i, a coproc's name_PID follows it
+static int respawnWorker(struct workerPool* pool, int i, struct msh_io* io){
+    if(spawnWorker(pool, i) < 0){
+        return -1;
+    }
+    if(pool->pid_var != NULL){
+        char pid[32];
+        snprintf(pid, sizeof(pid), "%d", (int)pool->workers[i].pid);
+        io->setenv(pool->pid_var, pid);
+    }
+    return 0;
+}
+
+// Reap a worker that died with its request in flight and start a replacement,
+// once per request. Returns -1 when the request is lost
+static int replaceWorker(struct workerPool* pool, int i, struct msh_io* io){
+    struct poolWorker* worker = &pool->workers[i];
+    printf("Shell: pool worker %d exited\n", (int)worker->pid);
+    reapWorker(worker);
+    if(worker->retried){
+        return -1;
+    }
+    worker->retried = 1;
+    return respawnWorker(pool, i, io);
+}
+
+// Write the worker's request, to a replacement if the worker is gone.
+// Returns -1 when it couldn't be delivered
+static int sendRequest(struct workerPool* pool, int i, struct msh_io* io){
+    struct poolWorker* worker = &pool->workers[i];
+    while(worker->pid > 0){
+        struct msh_io to = { -1, worker->to_fd, -1, NULL, fdWrite, NULL, NULL, NULL };
+        if(fdWrite(&to, worker->request.data, worker->request.len) >= 0){
+            return 0;
+        }
+        if(replaceWorker(pool, i, io) < 0){
+            break;
+        }
+    }
+    return -1;
+}
+
+// Send every input line to an idle worker and write the replies in input order.
+// Each worker has at most one request outstanding, so the oldest request in
+// flight is always the next reply to print. A worker that dies is replaced and
+// its request sent again, a request that kills the replacement too is reported
+static int routePool(struct workerPool* pool, struct msh_io* io){
+    struct lineReader* input = malloc(sizeof(struct lineReader));
+    struct strBuf line = { NULL, 0, 0 };
+    int inflight[MAX_POOL_WORKERS];
+    int head = 0, count = 0;
+    int eof = 0;
+    int status = 0;
+
+    input->io = io;
+    input->start = input->end = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while(1){
+        // hand out lines while there are idle workers
+        for(int i = 0; i < pool->size && !eof; i++){
+            struct poolWorker* worker = &pool->workers[i];
+            // a slot whose worker was lost gets a fresh one
+            if(worker->busy || (worker->pid <= 0 && respawnWorker(pool, i, io) < 0)){
+                continue;
+            }
+            if(!readLine(input, &worker->request)){
+                eof = 1;
+                break;
+            }
+            bufAppend(&worker->request, "\n", 1);
+            worker->retried = 0;
+            if(sendRequest(pool, i, io) < 0){
+                printf("Shell: pool: lost %s", worker->request.data);
+                status = 1;
+                continue;
+            }
+            worker->busy = 1;
+            inflight[(head + count++) % MAX_POOL_WORKERS] = i;
+        }
+
+        if(count == 0){
+            if(eof){
+                break;
+            }
+            // every worker is gone
+            status = 1;
+            break;
+        }
+
+        // wait for the oldest request, asking a replacement if its worker died
+        int i = inflight[head];
+        struct poolWorker* worker = &pool->workers[i];
+        if(!readLine(&worker->from, &line)){
+            if(replaceWorker(pool, i, io) == 0 && sendRequest(pool, i, io) == 0){
+                continue;
+            }
+            printf("Shell: pool: lost %s", worker->request.data);
+            status = 1;
+        }
+        head = (head + 1) % MAX_POOL_WORKERS;
+        count--;
+        worker->busy = 0;
+        if(worker->pid <= 0){
+            continue;
+        }
+        bufAppend(&line, "\n", 1);
+        if(io->write(io, line.data, line.len) < 0){
+            status = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(line.data);
+    free(input);
+    return status;
+}
+
+// pool -s name N cmd...  starts N warm instances of cmd
+// pool -k name           stops them
+// pool name              filter: each input line goes to an idle instance,
+//                        its one line reply is written out in input order
+int builtinPool(int argc, char** argv, struct msh_io* io){
+    if(argc >= 5 && strcmp(argv[1], "-s") == 0){
+        int size = atoi(argv[3]);
+        if(size < 1 || size > MAX_POOL_WORKERS){
+            printf("Shell: pool: size must be 1-%d\n", MAX_POOL_WORKERS);
+            return 2;
+        }
+        pthread_mutex_lock(&pools_lock);
+        int running = (hashGet(&pools, argv[2]) != NULL);
+        if(!running){
+            hashPut(&pools, argv[2], startPool(size, &argv[4]));
+        }
+        pthread_mutex_unlock(&pools_lock);
+        if(running){
+            printf("Shell: pool: %s already running\n", argv[2]);
+            return 1;
+        }
+        return 0;
+    }
+
+    // a pool still routing in another stage is stopped by its last router
+    if(argc == 3 && strcmp(argv[1], "-k") == 0){
+        pthread_mutex_lock(&pools_lock);
+        struct workerPool* pool = hashRemove(&pools, argv[2]);
+        if(pool != NULL && pool->routers > 0){
+            pool->stopped = 1;
+        }
+        int idle = (pool != NULL && !pool->stopped);
+        pthread_mutex_unlock(&pools_lock);
+        if(pool == NULL){
+            printf("Shell: pool: %s: not found\n", argv[2]);
+            return 1;
+        }
+        if(idle){
+            stopPool(pool);
+        }
+        return 0;
+    }
+
+    if(argc == 2){
+        pthread_mutex_lock(&pools_lock);
+        struct workerPool* pool = hashGet(&pools, argv[1]);
+        if(pool != NULL){
+            pool->routers++;
+        }
+        pthread_mutex_unlock(&pools_lock);
+        if(pool == NULL){
+            printf("Shell: pool: %s: not found\n", argv[1]);
+            return 1;
+        }
+        int status = routePool(pool, io);
+
+        pthread_mutex_lock(&pools_lock);
+        int last = (--pool->routers == 0 && pool->stopped);
+        pthread_mutex_unlock(&pools_lock);
+        if(last){
+            stopPool(pool);
+        }
+        return status;
+    }
+
+    printf("Shell: Incorrect command\n");
+    return 2;
+}
+
+// coproc name cmd...  starts cmd as a long-lived process, sets name_PID
+// coproc name         sends input lines to it and writes its replies
+int builtinCoproc(int argc, char** argv, struct msh_io* io){
+    if(argc == 2){
+        char* route[] = { "pool", argv[1], NULL };
+        return builtinPool(2, route, io);
+    }
+    if(argc < 3){
+        printf("Shell: Incorrect command\n");
+        return 2;
+    }
+
+    char* start[MAX_ARGS + 3] = { "pool", "-s", argv[1], "1" };
+    for(int i = 2; i <= argc; i++){
+        start[i + 2] = argv[i];
+    }
+    int status = builtinPool(argc + 2, start, io);
+    if(status == 0){
+        char name[256], pid[32];
+        snprintf(name, sizeof(name), "%s_PID", argv[1]);
+        pthread_mutex_lock(&pools_lock);
+        struct workerPool* pool = hashGet(&pools, argv[1]);
+        if(pool != NULL){
+            pool->pid_var = strdup(name);
+            snprintf(pid, sizeof(pid), "%d", (int)pool->workers[0].pid);
+        }
+        pthread_mutex_unlock(&pools_lock);
+        if(pool != NULL){
+            io->setenv(name, pid);
+        }
+    }
+    return status;
+}
+
+// Execute a single command with tags, options, args
+// Takes an array for input to execvp()
+void executeCommand(char** args){
+    if(args[0] == NULL){
+        return;
+    }
+
+    // NAME=value sets a shell variable
+    char* eq = strchr(args[0], '=');
+    if(eq != NULL && eq != args[0] && args[1] == NULL){
+        *eq = '\0';
+        setenv(args[0], eq + 1, 1);
+        *eq = '=';
+        checkStdbuf();
+        last_status = 0;
+        return;
+    }
+
+    // Functions and builtins run inside the shell, no fork needed
+    struct shellFunc* func = hashGet(&functions, args[0]);
+    if(func != NULL){
+        callFunction(func, args);
+        return;
+    }
+    struct msh_builtin* builtin = lookupBuiltin(args[0]);
+    if(builtin != NULL){
+        last_status = runBuiltin(builtin, args, STDIN_FILENO, STDOUT_FILENO);
+        return;
+    }
+
+    // Look the path up here so the cache stays warm in the shell
+    resolveCommand(args[0]);
+
+    // Fork a child, whose image will be replaced by execvp()
+    pid_t pid = fork();
+
+    if(pid == -1){
+        // fork() failed
+        printf("Shell: Incorrect command\n");
+        last_status = 1;
+        return;
+    }
+    else if(pid == 0){
+        // child process
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+
+        execArgs(args);
+    }
+    else{
+        // parent process
+        // wait(NULL);
+        int status;
+        waitpid(pid, &status, WUNTRACED);
+        last_status = statusOf(status);
+    }
+}
+
+static double secondsBetween(struct timespec from, struct timespec to){
+    return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+static void pushJob(struct scheduler* sched, struct worker* worker, int job){
+    worker->queue[(worker->head + worker->count++) % sched->num_jobs] = job;
+}
+
+// Next job for an executor with a free slot, -1 when there is nothing left to run
+static int takeJob(struct scheduler* sched, struct worker* worker){
+    if(worker->count == 0){
+        // steal the back half of the longest queue
+        struct worker* victim = NULL;
+        for(int i = 0; i < sched->num_workers; i++){
+            struct worker* other = &sched->workers[i];
+            if(other != worker && other->count > 0 && (victim == NULL || other->count > victim->count)){
+                victim = other;
+            }
+        }
+        if(victim == NULL){
+            return -1;
+        }
+        int steal = (victim->count + 1) / 2;
+        for(int i = victim->count - steal; i < victim->count; i++){
+            pushJob(sched, worker, victim->queue[(victim->head + i) % sched->num_jobs]);
+        }
+        victim->count -= steal;
+    }
+
+    int job = worker->queue[worker->head];
+    worker->head = (worker->head + 1) % sched->num_jobs;
+    worker->count--;
+    return job;
+}
+
+// Run a job's command line in a forked child: simple commands are exec'd
+// straight away, anything else goes through executeLine
+static void execJob(char* cmd){
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+
+    char* line = strdup(cmd);
+    if(strpbrk(line, "|&#<>{}();") == NULL){
+        char* args[MAX_ARGS];
+        parseInput(line, args);
+        if(args[0] == NULL){
+            exitChild(EXIT_SUCCESS);
+        }
+        execArgs(args);
+    }
+    executeLine(line);
+    exitChild(last_status);
+}
+
+// Message payload shared with MSH_MSG_RUN: cwd, command line, environment
+static char* jobPayload(const char* cmd, uint32_t* len){
+    extern char** environ;
+    struct strBuf buf = { NULL, 0, 0 };
+    char cwd[4096];
+
+    if(getcwd(cwd, sizeof(cwd)) == NULL){
+        strcpy(cwd, "/");
+    }
+    bufAppend(&buf, cwd, strlen(cwd) + 1);
+    bufAppend(&buf, cmd, strlen(cmd) + 1);
+    for(char** env = environ; *env != NULL; env++){
+        bufAppend(&buf, *env, strlen(*env) + 1);
+    }
+    *len = buf.len;
+    return buf.data;
+}
+
+// Start a job on an executor, returns -1 when it could not be started there
+static int startJob(struct scheduler* sched, struct job* job, int worker_index){
+    struct worker* worker = &sched->workers[worker_index];
+
+    job->worker = worker_index;
+    job->fd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    if(worker->addr == NULL){
+        fflush(stdout);
+        job->pid = fork();
+        if(job->pid < 0){
+            return -1;
+        }
+        if(job->pid == 0){
+            if(job->out_fd >= 0){
+                dup2(job->out_fd, STDOUT_FILENO);
+            }
+            if(job->err_fd >= 0){
+                dup2(job->err_fd, STDERR_FILENO);
+            }
+            execJob(job->cmd);
+        }
+        // a pidfd lets child exits and remote output share one poll()
+        job->fd = syscall(SYS_pidfd_open, job->pid, 0);
+    }
+    else{
+        job->fd = connectAddr(worker->addr);
+        if(job->fd < 0){
+            return -1;
+        }
+        uint32_t len;
+        char* payload = jobPayload(job->cmd, &len);
+        int sent = sendMsg(job->fd, MSH_MSG_JOB, payload, len);
+        free(payload);
+        if(sent < 0){
+            close(job->fd);
+            job->fd = -1;
+            return -1;
+        }
+    }
+
+    job->state = JOB_RUNNING;
+    worker->running++;
+    return 0;
+}
+
+// Fail a job every executor was dropped before it could run
+static void failUnplaced(struct scheduler* sched, struct job* job){
+    printf("Shell: no executor left for job %d\n", job->index);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    finishJob(sched, job, 255);
+}
+
+// Queue the jobs that were waiting for this one on the executor that ran it,
+// or skip them (and everything after them) when it didn't succeed
+static void releaseDependents(struct scheduler* sched, struct job* job){
+    for(int i = 0; i < job->num_dependents; i++){
+        struct job* next = &sched->jobs[job->dependents[i]];
+        if(next->state != JOB_QUEUED){
+            continue;
+        }
+        if(job->state != JOB_DONE || (job->status != 0 && !sched->keep_going)){
+            next->state = JOB_SKIPPED;
+            sched->num_done++;
+            releaseDependents(sched, next);
+            continue;
+        }
+        if(--next->pending > 0){
+            continue;
+        }
+        next->released_by = job->index;
+
+        struct worker* worker = &sched->workers[job->worker];
+        for(int w = 0; w < sched->num_workers && worker->slots == 0; w++){
+            worker = &sched->workers[w];
+        }
+        if(worker->slots == 0){
+            failUnplaced(sched, next);
+            continue;
+        }
+        pushJob(sched, worker, next->index);
+    }
+}
+
+static void finishJob(struct scheduler* sched, struct job* job, int status){
+    if(job->fd >= 0){
+        close(job->fd);
+        job->fd = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->end);
+    if(job->state == JOB_RUNNING){
+        sched->workers[job->worker].running--;
+    }
+    job->status = status;
+    job->state = JOB_DONE;
+    sched->num_done++;
+
+    if(sched->finished != NULL){
+        sched->finished(sched, job);
+    }
+    releaseDependents(sched, job);
+}
+
+// A running job's fd is readable: the local child exited, or the daemon sent output / the exit status
+static void handleJobEvent(struct scheduler* sched, struct job* job){
+    if(sched->workers[job->worker].addr == NULL){
+        int status;
+        if(waitpid(job->pid, &status, WNOHANG) == job->pid){
+            finishJob(sched, job, statusOf(status));
+        }
+        return;
+    }
+
+    struct msh_msg_hdr hdr;
+    char* payload;
+    int fds[1];
+    int num_fds;
+    if(recvMsg(job->fd, &hdr, &payload, fds, 1, &num_fds) <= 0){
+        printf("Shell: worker %s: lost job %d\n", sched->workers[job->worker].addr, job->index);
+        finishJob(sched, job, 255);
+        return;
+    }
+
+    if(hdr.type == MSH_MSG_OUT || hdr.type == MSH_MSG_ERR){
+        int to = (hdr.type == MSH_MSG_OUT) ? job->out_fd : job->err_fd;
+        if(to < 0){
+            to = (hdr.type == MSH_MSG_OUT) ? STDOUT_FILENO : STDERR_FILENO;
+        }
+        struct msh_io out = { -1, to, -1, NULL, fdWrite, NULL, NULL, NULL };
+        fflush(stdout);
+        fdWrite(&out, payload, hdr.len);
+    }
+    else if(hdr.type == MSH_MSG_EXIT && hdr.len == sizeof(int32_t)){
+        int32_t status;
+        memcpy(&status, payload, sizeof(status));
+        finishJob(sched, job, status);
+    }
+    free(payload);
+}
+
+// Job durations of earlier runs, keyed by the normalized command line.
+// $MSH_STATS, else ~/.myshell_stats; an empty MSH_STATS turns it off.
+// Lines are "seconds<TAB>runs<TAB>command"
+#define STATS_WEIGHT 0.3    // weight of the newest run in the moving average
+
+struct jobStat {
+    double secs;
+    int runs;
+};
+
+static const char* statsPath(char* buf, size_t len){
+    const char* path = getenv("MSH_STATS");
+    if(path != NULL){
+        return (*path != '\0') ? path : NULL;
+    }
+    const char* home = getenv("HOME");
+    if(home == NULL){
+        return NULL;
+    }
+    snprintf(buf, len, "%s/.myshell_stats", home);
+    return buf;
+}
+
+// Collapse whitespace so "a  b" and "a b" share their history
+static char* normalizeCommand(const char* cmd){
+    char* norm = malloc(strlen(cmd) + 1);
+    char* out = norm;
+    while(isspace((unsigned char)*cmd)){
+        cmd++;
+    }
+    while(*cmd != '\0'){
+        if(isspace((unsigned char)*cmd)){
+            while(isspace((unsigned char)*cmd)){
+                cmd++;
+            }
+            if(*cmd != '\0'){
+                *out++ = ' ';
+            }
+            continue;
+        }
+        *out++ = *cmd++;
+    }
+    *out = '\0';
+    return norm;
+}
+
+static void readJobStats(int fd, struct hashTable* stats){
+    FILE* file = fdopen(dup(fd), "r");
+    if(file == NULL){
+        return;
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    while(getline(&line, &cap, file) > 0){
+        char* rest = line;
+        char* secs = strsep(&rest, "\t");
+        char* runs = strsep(&rest, "\t");
+        if(rest == NULL){
+            continue;
+        }
+        rest[strcspn(rest, "\n")] = '\0';
+        struct jobStat* stat = malloc(sizeof(struct jobStat));
+        stat->secs = atof(secs);
+        stat->runs = atoi(runs);
+        free(hashPut(stats, rest, stat));
+    }
+    free(line);
+    fclose(file);
+}
+
+static void clearTable(struct hashTable* table){
+    for(int b = 0; b < HASH_BUCKETS; b++){
+        while(table->buckets[b] != NULL){
+            free(hashRemove(table, table->buckets[b]->key));
+        }
+    }
+}
+
+static int compareExpected(const void* a, const void* b){
+    const struct job* x = *(struct job* const*)a;
+    const struct job* y = *(struct job* const*)b;
+    if(x->expected != y->expected){
+        return (x->expected < y->expected) ? 1 : -1;
+    }
+    return x->index - y->index;
+}
+
+// Longest processing time first: known jobs by their past duration, unknown
+// ones get the median so they start in the middle
+static void orderJobs(struct scheduler* sched, int* order){
+    struct hashTable stats = { { NULL } };
+    char buf[4096];
+    const char* path = statsPath(buf, sizeof(buf));
+    int fd = (path != NULL) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if(fd >= 0){
+        flock(fd, LOCK_SH);
+        readJobStats(fd, &stats);
+        close(fd);
+    }
+
+    struct job** sorted = malloc(sizeof(struct job*) * (sched->num_jobs + 1));
+    int num_known = 0;
+    for(int i = 0; i < sched->num_jobs; i++){
+        char* norm = normalizeCommand(sched->jobs[i].cmd);
+        struct jobStat* stat = hashGet(&stats, norm);
+        free(norm);
+        sched->jobs[i].expected = (stat != NULL) ? stat->secs : -1;
+        if(stat != NULL){
+            sorted[num_known++] = &sched->jobs[i];
+        }
+    }
+
+    double median = 0;
+    if(num_known > 0){
+        qsort(sorted, num_known, sizeof(struct job*), compareExpected);
+        median = sorted[num_known / 2]->expected;
+    }
+    for(int i = 0; i < sched->num_jobs; i++){
+        if(sched->jobs[i].expected < 0){
+            sched->jobs[i].expected = median;
+        }
+        sorted[i] = &sched->jobs[i];
+    }
+    qsort(sorted, sched->num_jobs, sizeof(struct job*), compareExpected);
+    for(int i = 0; i < sched->num_jobs; i++){
+        order[i] = sorted[i]->index;
+    }
+
+    free(sorted);
+    clearTable(&stats);
+}
+
+// Fold the durations of the jobs that succeeded here into the stats file.
+// The file is rewritten in place under an exclusive lock so concurrent shells merge
+static void saveJobStats(struct scheduler* sched){
+    char buf[4096];
+    const char* path = statsPath(buf, sizeof(buf));
+    int ran = 0;
+    for(int i = 0; i < sched->num_jobs; i++){
+        ran |= (sched->jobs[i].state == JOB_DONE && sched->jobs[i].status == 0);
+    }
+    if(path == NULL || !ran){
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0){
+        return;
+    }
+    flock(fd, LOCK_EX);
+
+    struct hashTable stats = { { NULL } };
+    readJobStats(fd, &stats);
+    for(int i = 0; i < sched->num_jobs; i++){
+        struct job* job = &sched->jobs[i];
+        if(job->state != JOB_DONE || job->status != 0){
+            continue;
+        }
+        double secs = (job->end.tv_sec - job->start.tv_sec) + (job->end.tv_nsec - job->start.tv_nsec) / 1e9;
+        char* norm = normalizeCommand(job->cmd);
+        struct jobStat* stat = hashGet(&stats, norm);
+        if(stat == NULL){
+            stat = calloc(1, sizeof(struct jobStat));
+            stat->secs = secs;
+            hashPut(&stats, norm, stat);
+        }
+        else{
+            stat->secs = STATS_WEIGHT * secs + (1 - STATS_WEIGHT) * stat->secs;
+        }
+        stat->runs++;
+        free(norm);
+    }
+
+    struct strBuf out = { NULL, 0, 0 };
+    bufAppend(&out, "", 0);
+    for(int b = 0; b < HASH_BUCKETS; b++){
+        for(struct hashEntry* entry = stats.buckets[b]; entry != NULL; entry = entry->next){
+            struct jobStat* stat = entry->value;
+            char num[64];
+            int len = snprintf(num, sizeof(num), "%.3f\t%d\t", stat->secs, stat->runs);
+            bufAppend(&out, num, len);
+            bufAppend(&out, entry->key, strlen(entry->key));
+            bufAppend(&out, "\n", 1);
+        }
+    }
+    if(ftruncate(fd, 0) < 0 || pwrite(fd, out.data, out.len, 0) != (ssize_t)out.len){
+        perror("Shell: job stats");
+    }
+
+    free(out.data);
+    clearTable(&stats);
+    close(fd);     // drops the lock
+}
+
+// Milliseconds between status lines for HZ, at least 1 so a high rate can't turn them
+// off, at most an hour so a tiny one still fits an int
+static int progressInterval(double hz){
+    double ms = 1000 / hz;
+    return (ms < 1) ? 1 : (ms > 3600 * 1000) ? 3600 * 1000 : (int)ms;
+}
+
+// Executors come from MSH_WORKERS, e.g. "local:4,unix:/tmp/w1.sock:8,tcp:host:7000:8"
+// (the last field is the slot count). Without it the shell runs local_slots jobs at once
+void initScheduler(struct scheduler* sched, struct job* jobs, int num_jobs, int local_slots){
+    memset(sched, 0, sizeof(*sched));
+    sched->jobs = jobs;
+    sched->num_jobs = num_jobs;
+
+    // MSH_PROGRESS=HZ shows a status line that often per second
+    const char* progress = getenv("MSH_PROGRESS");
+    if(progress != NULL && atof(progress) > 0){
+        sched->progress_ms = progressInterval(atof(progress));
+    }
+
+    for(int i = 0; i < num_jobs; i++){
+        jobs[i].index = i;
+        jobs[i].state = JOB_QUEUED;
+        jobs[i].status = -1;
+        jobs[i].fd = -1;
+        jobs[i].out_fd = -1;
+        jobs[i].err_fd = -1;
+        jobs[i].released_by = -1;
+    }
+
+    const char* spec = getenv("MSH_WORKERS");
+    if(spec == NULL || *spec == '\0'){
+        sched->workers[0].slots = local_slots;
+        sched->num_workers = 1;
+    }
+    else{
+        char* list = strdup(spec);
+        char* rest = list;
+        char* entry;
+        while((entry = strsep(&rest, ",")) != NULL && sched->num_workers < MAX_WORKERS){
+            entry = trimStr(entry);
+            char* colon = strrchr(entry, ':');
+            if(colon == NULL || atoi(colon + 1) < 1){
+                printf("Shell: MSH_WORKERS: bad entry '%s'\n", entry);
+                continue;
+            }
+            struct worker* worker = &sched->workers[sched->num_workers++];
+            worker->slots = atoi(colon + 1);
+            *colon = '\0';
+            worker->addr = (strcmp(entry, "local") == 0) ? NULL : strdup(entry);
+        }
+        free(list);
+        if(sched->num_workers == 0){
+            sched->workers[0].slots = local_slots;
+            sched->num_workers = 1;
+        }
+    }
+
+    // deal the jobs out in proportion to the slots, longest expected first.
+    // Jobs with dependencies are queued once those succeed
+    int* order = malloc(sizeof(int) * (num_jobs > 0 ? num_jobs : 1));
+    orderJobs(sched, order);
+
+    int total_slots = 0;
+    for(int i = 0; i < sched->num_workers; i++){
+        sched->workers[i].queue = malloc(sizeof(int) * (num_jobs > 0 ? num_jobs : 1));
+        total_slots += sched->workers[i].slots;
+    }
+    int dealt = 0;
+    for(int i = 0; i < num_jobs; i++){
+        if(jobs[order[i]].pending > 0){
+            continue;
+        }
+        int slot = dealt++ % total_slots;
+        int w = 0;
+        while(slot >= sched->workers[w].slots){
+            slot -= sched->workers[w].slots;
+            w++;
+        }
+        pushJob(sched, &sched->workers[w], order[i]);
+    }
+    free(order);
+}
+
+void freeScheduler(struct scheduler* sched){
+    for(int i = 0; i < sched->num_workers; i++){
+        free(sched->workers[i].queue);
+        free(sched->workers[i].addr);
+    }
+}
+
+// An executor that can't be reached hands its queue to the others
+static void dropWorker(struct scheduler* sched, int index){
+    struct worker* worker = &sched->workers[index];
+    printf("Shell: worker %s unreachable\n", worker->addr);
+    worker->slots = 0;
+
+    struct worker* heir = NULL;
+    for(int i = 0; i < sched->num_workers; i++){
+        if(sched->workers[i].slots > 0 && (heir == NULL || sched->workers[i].slots > heir->slots)){
+            heir = &sched->workers[i];
+        }
+    }
+    for(; worker->count > 0; worker->count--){
+        int job = worker->queue[worker->head];
+        worker->head = (worker->head + 1) % sched->num_jobs;
+        if(heir != NULL){
+            pushJob(sched, heir, job);
+        }
+        else{
+            failUnplaced(sched, &sched->jobs[job]);
+        }
+    }
+}
+
+// One status line: counts, throughput, an ETA from the mean duration so far and
+// the jobs running longest. Written with a single write() so it never tears.
+// On a terminal it is redrawn in place, elsewhere every update is a line of its own
+static void drawProgress(struct scheduler* sched, int final){
+    int tty = isatty(STDERR_FILENO);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sched->drawn = now;
+
+    int running = 0, failed = 0, finished = 0, slots = 0;
+    double busy = 0;
+    struct job* slowest[3] = { NULL, NULL, NULL };
+    for(int i = 0; i < sched->num_jobs; i++){
+        struct job* job = &sched->jobs[i];
+        if(job->state == JOB_DONE){
+            finished++;
+            failed += (job->status != 0);
+            busy += secondsBetween(job->start, job->end);
+        }
+        else if(job->state == JOB_RUNNING){
+            running++;
+            // keep the three that started first
+            for(int k = 0; k < 3; k++){
+                if(slowest[k] == NULL || secondsBetween(job->start, slowest[k]->start) > 0){
+                    memmove(&slowest[k + 1], &slowest[k], (2 - k) * sizeof(struct job*));
+                    slowest[k] = job;
+                    break;
+                }
+            }
+        }
+    }
+    for(int w = 0; w < sched->num_workers; w++){
+        slots += sched->workers[w].slots;
+    }
+    int queued = sched->num_jobs - sched->num_done - running;
+    double elapsed = secondsBetween(sched->began, now);
+
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%s%d running, %d queued, %d done, %d failed, %.1f jobs/s",
+                       tty ? "\r" : "", running, queued, sched->num_done, failed, elapsed > 0 ? sched->num_done / elapsed : 0.0);
+    if(finished > 0 && !final){
+        // what is left of the running jobs plus the queue, spread over the slots
+        double mean = busy / finished;
+        double left = queued * mean;
+        for(int i = 0; i < sched->num_jobs; i++){
+            if(sched->jobs[i].state == JOB_RUNNING){
+                double ran = secondsBetween(sched->jobs[i].start, now);
+                left += (ran < mean) ? mean - ran : 0;
+            }
+        }
+        int eta = (int)(left / (slots > 0 ? slots : 1) + 0.5);
+        len += snprintf(line + len, sizeof(line) - len, ", ETA %dm%02ds", eta / 60, eta % 60);
+    }
+    for(int k = 0; k < 3 && slowest[k] != NULL && len < (int)sizeof(line); k++){
+        len += snprintf(line + len, sizeof(line) - len, "%s%.20s (%.1fs)", (k == 0) ? " | " : ", ",
+                        slowest[k]->cmd, secondsBetween(slowest[k]->start, now));
+    }
+    if(len > (int)sizeof(line) - 5){
+        len = sizeof(line) - 5;
+    }
+    len += snprintf(line + len, sizeof(line) - len, "%s%s", tty ? "\033[K" : "", (final || !tty) ? "\n" : "");
+    if(write(STDERR_FILENO, line, len) < 0){
+        sched->progress_ms = 0;
+    }
+}
+
+// Run every job to completion
+void runScheduler(struct scheduler* sched){
+    clock_gettime(CLOCK_MONOTONIC, &sched->began);
+    sched->drawn = sched->began;
+    struct pollfd* fds = malloc(sizeof(struct pollfd) * (sched->num_jobs + 1));
+    int* polled = malloc(sizeof(int) * (sched->num_jobs + 1));
+
+    while(sched->num_done < sched->num_jobs){
+        // fill the free slots
+        for(int w = 0; w < sched->num_workers; w++){
+            struct worker* worker = &sched->workers[w];
+            while(worker->running < worker->slots){
+                int job = takeJob(sched, worker);
+                if(job < 0){
+                    break;
+                }
+                if(sched->claim != NULL && !sched->claim(sched, &sched->jobs[job])){
+                    sched->jobs[job].state = JOB_SKIPPED;
+                    sched->num_done++;
+                    releaseDependents(sched, &sched->jobs[job]);
+                    continue;
+                }
+                if(sched->starting != NULL){
+                    sched->starting(sched, &sched->jobs[job]);
+                }
+                if(startJob(sched, &sched->jobs[job], w) < 0){
+                    if(worker->addr == NULL){
+                        printf("Shell: Incorrect command\n");
+                        finishJob(sched, &sched->jobs[job], 1);
+                        continue;
+                    }
+                    pushJob(sched, worker, job);
+                    dropWorker(sched, w);
+                    break;
+                }
+            }
+        }
+
+        // wait for any running job
+        int num_fds = 0;
+        int timeout = -1;
+        for(int i = 0; i < sched->num_jobs; i++){
+            struct job* job = &sched->jobs[i];
+            if(job->state != JOB_RUNNING){
+                continue;
+            }
+            if(job->fd < 0){
+                timeout = 10;   // no pidfd on this kernel, check the child now and then
+                continue;
+            }
+            fds[num_fds].fd = job->fd;
+            fds[num_fds].events = POLLIN;
+            polled[num_fds++] = i;
+        }
+        if(num_fds == 0 && timeout < 0){
+            break;
+        }
+        // wake up in time for the next status line
+        if(sched->progress_ms > 0){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int due = sched->progress_ms - (int)(secondsBetween(sched->drawn, now) * 1000);
+            due = (due > 0) ? due : 0;
+            timeout = (timeout < 0 || due < timeout) ? due : timeout;
+        }
+
+        if(poll(fds, num_fds, timeout) < 0 && errno != EINTR){
+            break;
+        }
+        for(int i = 0; i < num_fds; i++){
+            if(fds[i].revents != 0){
+                handleJobEvent(sched, &sched->jobs[polled[i]]);
+            }
+        }
+        if(timeout >= 0){
+            for(int i = 0; i < sched->num_jobs; i++){
+                if(sched->jobs[i].state == JOB_RUNNING && sched->jobs[i].fd < 0){
+                    handleJobEvent(sched, &sched->jobs[i]);
+                }
+            }
+        }
+        if(sched->progress_ms > 0){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if(secondsBetween(sched->drawn, now) * 1000 >= sched->progress_ms){
+                drawProgress(sched, 0);
+            }
+        }
+    }
+    if(sched->progress_ms > 0){
+        drawProgress(sched, 1);
+    }
+
+    free(fds);
+    free(polled);
+    saveJobStats(sched);
+}
+
+// Execute multiple commands with tags, options, args in parallel.
+// With MSH_WORKERS set they are spread over myshell daemons as well
+void executeParallelCommands(char* input_str){
+    int num = 0;
+    struct job* jobs = calloc(strlen(input_str) / 2 + 1, sizeof(struct job));
+    char* command;
+
+    // Split commands by "&&"
+    while((command = strsep(&input_str, "&&")) != NULL){
+        command = trimStr(command);
+        if(*command != '\0'){
+            jobs[num++].cmd = command;
+        }
+    }
+
+    struct scheduler sched;
+    initScheduler(&sched, jobs, num, num);     // all at once unless MSH_WORKERS says otherwise
+    runScheduler(&sched);
+    freeScheduler(&sched);
+
+    // $? is the first failure
+    last_status = 0;
+    for(int i = 0; i < num; i++){
+        if(i < MAX_PROCS){
+            stage_statuses[i] = jobs[i].status;
+        }
+        if(last_status == 0){
+            last_status = jobs[i].status;
+        }
+    }
+    num_stage_statuses = (num < MAX_PROCS) ? num : MAX_PROCS;
+    free(jobs);
+}
+
+// Claims shared by every shell draining the same job file: a bitmap in
+// jobfile.claims, set with atomic or through a shared mapping, or under a
+// fcntl() lock where the file system can't map it shared
+struct jobClaims {
+    int fd;
+    uint64_t* map;          // NULL in fcntl mode
+    int log_fd;             // jobfile.log, completion records
+
+    // --results DIR: every job writes DIR/NAME.out and .err itself,
+    // DIR/index.tsv lists them with exit codes and timings
+    const char* results;
+    int index_fd;
+    int width;              // digits of the highest job index
+};
+
+static int claimJob(struct scheduler* sched, struct job* job){
+    struct jobClaims* claims = sched->data;
+    uint64_t bit = 1ULL << (job->index % 64);
+
+    if(claims->map != NULL){
+        return (__atomic_fetch_or(&claims->map[job->index / 64], bit, __ATOMIC_ACQ_REL) & bit) == 0;
+    }
+
+    // lock just this word of the bitmap, read, set, write back
+    off_t off = (off_t)(job->index / 64) * sizeof(uint64_t);
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = off, .l_len = sizeof(uint64_t) };
+    uint64_t word = 0;
+    int won = 0;
+
+    while(fcntl(claims->fd, F_SETLKW, &lock) < 0 && errno == EINTR);
+    if(pread(claims->fd, &word, sizeof(word), off) >= 0 && (word & bit) == 0){
+        word |= bit;
+        won = pwrite(claims->fd, &word, sizeof(word), off) == sizeof(word);
+    }
+    lock.l_type = F_UNLCK;
+    fcntl(claims->fd, F_SETLK, &lock);
+    return won;
+}
+
+// NAME of a job's result files: index and command line, reduced to file name characters
+static void resultName(struct jobClaims* claims, struct job* job, char* name, size_t len){
+    int used = snprintf(name, len, "%0*d_", claims->width, job->index);
+    for(const char* c = job->cmd; *c != '\0' && used < 64 && (size_t)used < len - 1; c++){
+        name[used++] = (isalnum((unsigned char)*c) || strchr(".-", *c) != NULL) ? *c : '_';
+    }
+    name[used] = '\0';
+}
+
+// Scheduler hook: point the job's stdout / stderr straight at its result files
+static void openResults(struct scheduler* sched, struct job* job){
+    struct jobClaims* claims = sched->data;
+    char name[128], path[4096 + 160];
+    if(job->out_fd >= 0){
+        return;     // restarted on another executor
+    }
+
+    resultName(claims, job, name, sizeof(name));
+    snprintf(path, sizeof(path), "%s/%s.out", claims->results, name);
+    job->out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    snprintf(path, sizeof(path), "%s/%s.err", claims->results, name);
+    job->err_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+// index, status, seconds, host:pid, command. One write() per record so
+// appends from several shells don't interleave. With --results the job also
+// gets its row in index.tsv and its result files are closed
+static void logJob(struct scheduler* sched, struct job* job){
+    struct jobClaims* claims = sched->data;
+    char host[64] = "";
+    char record[4096];
+
+    gethostname(host, sizeof(host) - 1);
+    double secs = (job->end.tv_sec - job->start.tv_sec) + (job->end.tv_nsec - job->start.tv_nsec) / 1e9;
+    int len = snprintf(record, sizeof(record), "%d\t%d\t%.3f\t%s:%d\t%s\n",
+                       job->index, job->status, secs, host, (int)getpid(), job->cmd);
+    if(len >= (int)sizeof(record)){
+        len = sizeof(record) - 1;
+        record[len - 1] = '\n';
+    }
+    if(write(claims->log_fd, record, len) < 0){
+        perror("Shell: batch log");
+    }
+
+    if(claims->results != NULL){
+        char name[128];
+        resultName(claims, job, name, sizeof(name));
+        len = snprintf(record, sizeof(record), "%d\t%d\t%.3f\t%s.out\t%s.err\t%s\n",
+                       job->index, job->status, secs, name, name, job->cmd);
+        if(len >= (int)sizeof(record)){
+            len = sizeof(record) - 1;
+            record[len - 1] = '\n';
+        }
+        if(write(claims->index_fd, record, len) < 0){
+            perror("Shell: batch results");
+        }
+        for(int* fd = &job->out_fd; fd <= &job->err_fd; fd++){
+            if(*fd >= 0){
+                close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+}
+
+// Read a job file: one command line per line, blank lines and # comments skipped.
+// Returns the file contents the jobs point into, NULL on failure
+static char* loadJobFile(const char* path, struct job** jobs, int* num_jobs){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0){
+        if(fd >= 0){
+            close(fd);
+        }
+        return NULL;
+    }
+
+    char* text = malloc(st.st_size + 1);
+    ssize_t len = (st.st_size > 0) ? read(fd, text, st.st_size) : 0;
+    close(fd);
+    if(len < 0){
+        free(text);
+        return NULL;
+    }
+    text[len] = '\0';
+
+    *jobs = calloc(len / 2 + 1, sizeof(struct job));
+    *num_jobs = 0;
+    char* rest = text;
+    char* line;
+    while((line = strsep(&rest, "\n")) != NULL){
+        line = trimStr(line);
+        if(*line != '\0' && *line != '#'){
+            (*jobs)[(*num_jobs)++].cmd = line;
+        }
+    }
+    return text;
+}
+
+// jobs[after] waits for jobs[before]
+static void addDependency(struct job* jobs, int before, int after){
+    jobs[before].dependents = realloc(jobs[before].dependents, sizeof(int) * (jobs[before].num_dependents + 1));
+    jobs[before].dependents[jobs[before].num_dependents++] = after;
+    jobs[after].pending++;
+}
+
+static struct job* findJob(struct job* jobs, int num_jobs, const char* name){
+    for(int i = 0; i < num_jobs; i++){
+        if(jobs[i].name != NULL && strcmp(jobs[i].name, name) == 0){
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+// Split "job name: dep dep -- cmd" lines into name, dependencies and command.
+// Returns 1 when the file has any, 0 for a plain job file, -1 when a dependency
+// is unknown or they form a cycle
+static int linkJobs(struct job* jobs, int num_jobs){
+    int linked = 0;
+    char** deps = calloc(num_jobs + 1, sizeof(char*));
+
+    for(int i = 0; i < num_jobs; i++){
+        char* cmd = strstr(jobs[i].cmd, " -- ");
+        char* colon = strchr(jobs[i].cmd, ':');
+        if(strncmp(jobs[i].cmd, "job ", 4) != 0 || cmd == NULL || colon == NULL || colon > cmd){
+            continue;
+        }
+        *colon = '\0';
+        *cmd = '\0';
+        jobs[i].name = trimStr(jobs[i].cmd + 4);
+        deps[i] = colon + 1;
+        jobs[i].cmd = trimStr(cmd + 4);
+        linked = 1;
+    }
+
+    int ok = 1;
+    for(int i = 0; i < num_jobs && ok; i++){
+        char* dep;
+        while(deps[i] != NULL && (dep = strsep(&deps[i], " \t")) != NULL){
+            if(*dep == '\0'){
+                continue;
+            }
+            struct job* before = findJob(jobs, num_jobs, dep);
+            if(before == NULL){
+                printf("Shell: batch: %s: unknown job '%s'\n", jobs[i].name, dep);
+                ok = 0;
+                break;
+            }
+            addDependency(jobs, before - jobs, i);
+        }
+    }
+
+    // Kahn's algorithm: whatever never becomes ready is on a cycle
+    int* pending = malloc(sizeof(int) * (num_jobs + 1));
+    int* ready = malloc(sizeof(int) * (num_jobs + 1));
+    int num_ready = 0, seen = 0;
+    for(int i = 0; i < num_jobs; i++){
+        pending[i] = jobs[i].pending;
+        if(pending[i] == 0){
+            ready[num_ready++] = i;
+        }
+    }
+    while(num_ready > 0){
+        struct job* job = &jobs[ready[--num_ready]];
+        seen++;
+        for(int d = 0; d < job->num_dependents; d++){
+            if(--pending[job->dependents[d]] == 0){
+                ready[num_ready++] = job->dependents[d];
+            }
+        }
+    }
+    if(ok && seen < num_jobs){
+        printf("Shell: batch: dependency cycle\n");
+        ok = 0;
+    }
+
+    free(pending);
+    free(ready);
+    free(deps);
+    return ok ? linked : -1;
+}
+
+// The chain of jobs that decided the wall time: from the job that finished
+// last back through the dependency that released each one
+static void reportCriticalPath(struct job* jobs, int num_jobs){
+    struct job* last = NULL;
+    struct job* first = NULL;
+    int skipped = 0;
+    for(int i = 0; i < num_jobs; i++){
+        if(jobs[i].state == JOB_SKIPPED){
+            skipped++;
+        }
+        if(jobs[i].state != JOB_DONE){
+            continue;
+        }
+        if(last == NULL || secondsBetween(last->end, jobs[i].end) > 0){
+            last = &jobs[i];
+        }
+        if(first == NULL || secondsBetween(jobs[i].start, first->start) > 0){
+            first = &jobs[i];
+        }
+    }
+    if(last == NULL){
+        return;
+    }
+
+    int* path = malloc(sizeof(int) * (num_jobs + 1));
+    int len = 0;
+    double total = 0;
+    for(struct job* job = last; job != NULL; job = (job->released_by < 0) ? NULL : &jobs[job->released_by]){
+        path[len++] = job->index;
+        total += secondsBetween(job->start, job->end);
+    }
+
+    double wall = secondsBetween(first->start, last->end);
+    printf("critical path %.3fs of %.3fs wall", total, wall);
+    if(skipped > 0){
+        printf(", %d skipped after a failure", skipped);
+    }
+    printf("\n");
+    while(len > 0){
+        struct job* job = &jobs[path[--len]];
+        printf("  %-20s %8.3fs  %s\n", (job->name != NULL) ? job->name : "-", secondsBetween(job->start, job->end), job->cmd);
+    }
+    free(path);
+}
+
+// batch [-j N] [-r] jobfile
+// Runs the job file N at a time (default: number of CPUs). Any number of shells can
+// drain the same file together, each job runs once. -r forgets earlier claims.
+// --results DIR keeps every job's stdout and stderr in files of their own,
+// --progress[=HZ] shows a status line on stderr (4 times a second by default).
+// A file with "job name: deps -- cmd" lines runs as a graph in this shell alone,
+// every job starts once its dependencies succeeded
+int builtinBatch(int argc, char** argv, struct msh_io* io){
+    (void)io;
+    int slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int reset = 0;
+    const char* results = NULL;
+    double progress_hz = 0;
+    int i;
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++){
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc){
+            slots = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--results") == 0 && i + 1 < argc){
+            results = argv[++i];
+        }
+        else if(strncmp(argv[i], "--progress", 10) == 0 && (argv[i][10] == '\0' || argv[i][10] == '=')){
+            progress_hz = (argv[i][10] == '=') ? atof(argv[i] + 11) : 4;
+        }
+        else if(strcmp(argv[i], "-r") == 0){
+            reset = 1;
+        }
+        else{
+            break;
+        }
+    }
+    if(i != argc - 1 || slots < 1 || progress_hz < 0){
+        printf("Shell: Incorrect command\n");
+        return 2;
+    }
+    const char* path = argv[i];
+
+    struct job* jobs;
+    int num_jobs;
+    char* text = loadJobFile(path, &jobs, &num_jobs);
+    if(text == NULL){
+        printf("Shell: batch: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    int graph = linkJobs(jobs, num_jobs);
+    if(graph < 0){
+        for(int j = 0; j < num_jobs; j++){
+            free(jobs[j].dependents);
+        }
+        free(text);
+        free(jobs);
+        return 2;
+    }
+
+    // jobfile.claims and jobfile.log sit next to the job file
+    char claims_path[4096], log_path[4096];
+    snprintf(claims_path, sizeof(claims_path), "%s.claims", path);
+    snprintf(log_path, sizeof(log_path), "%s.log", path);
+
+    struct jobClaims claims;
+    size_t map_len = ((num_jobs + 63) / 64) * sizeof(uint64_t);
+    claims.fd = open(claims_path, O_RDWR | O_CREAT | O_CLOEXEC | (reset ? O_TRUNC : 0), 0644);
+    claims.log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (reset ? O_TRUNC : 0), 0644);
+    if(claims.fd < 0 || claims.log_fd < 0){
+        printf("Shell: batch: %s\n", strerror(errno));
+        free(text);
+        free(jobs);
+        return 1;
+    }
+
+    // growing is idempotent, so racing shells agree on the size
+    struct stat st;
+    if(fstat(claims.fd, &st) == 0 && (size_t)st.st_size < map_len && ftruncate(claims.fd, map_len) < 0){
+        perror("Shell: batch");
+    }
+    claims.map = NULL;
+    if(map_len > 0){
+        void* map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, claims.fd, 0);
+        claims.map = (map == MAP_FAILED) ? NULL : map;
+    }
+
+    claims.results = results;
+    claims.index_fd = -1;
+    claims.width = snprintf(NULL, 0, "%d", num_jobs > 0 ? num_jobs - 1 : 0);
+    if(results != NULL){
+        char index_path[4096 + 16];
+        snprintf(index_path, sizeof(index_path), "%s/index.tsv", results);
+        if(mkdir(results, 0755) < 0 && errno != EEXIST){
+            printf("Shell: batch: %s: %s\n", results, strerror(errno));
+        }
+        claims.index_fd = open(index_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (reset ? O_TRUNC : 0), 0644);
+        if(claims.index_fd >= 0 && fstat(claims.index_fd, &st) == 0 && st.st_size == 0){
+            const char* header = "index\tstatus\tseconds\tstdout\tstderr\tcommand\n";
+            if(write(claims.index_fd, header, strlen(header)) < 0){
+                perror("Shell: batch results");
+            }
+        }
+        else if(claims.index_fd < 0){
+            claims.results = NULL;
+            printf("Shell: batch: %s: %s\n", index_path, strerror(errno));
+        }
+    }
+
+    struct scheduler sched;
+    initScheduler(&sched, jobs, num_jobs, slots);
+    sched.claim = graph ? NULL : claimJob;     // a graph can't be split between shells
+    sched.starting = (claims.results != NULL) ? openResults : NULL;
+    if(progress_hz > 0){
+        sched.progress_ms = progressInterval(progress_hz);
+    }
+    sched.finished = logJob;
+    sched.data = &claims;
+    runScheduler(&sched);
+    freeScheduler(&sched);
+    if(graph){
+        reportCriticalPath(jobs, num_jobs);
+    }
+
+    // $? is the first failure among the jobs this shell ran
+    int status = 0;
+    for(int j = 0; j < num_jobs; j++){
+        if(jobs[j].state == JOB_DONE && status == 0){
+            status = jobs[j].status;
+        }
+        free(jobs[j].dependents);
+    }
+
+    if(claims.map != NULL){
+        munmap(claims.map, map_len);
+    }
+    close(claims.fd);
+    close(claims.log_fd);
+    if(claims.index_fd >= 0){
+        close(claims.index_fd);
+    }
+    free(text);
+    free(jobs);
+    return status;
+}
+
+// Memo database: what the inputs and outputs of every memoized command looked
+// like after its last successful run. $MSH_MEMO, else .myshell_memo in the
+// current directory. Lines are "key<TAB>path<TAB>size<TAB>mtime<TAB>hash"
+struct fileSig {
+    long long size;
+    long long mtime;        // nanoseconds
+    uint64_t hash;          // FNV-1a of the contents
+};
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t len){
+    const unsigned char* bytes = data;
+    for(size_t i = 0; i < len; i++){
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Size and mtime of path, and its content hash unless they match what is known.
+// Returns -1 when the file doesn't exist
+static int fileSignature(const char* path, struct fileSig* sig, const struct fileSig* known){
+    struct stat st;
+    if(stat(path, &st) < 0){
+        return -1;
+    }
+    sig->size = st.st_size;
+    sig->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    if(known != NULL && known->size == sig->size && known->mtime == sig->mtime){
+        sig->hash = known->hash;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return -1;
+    }
+    char buf[LINE_BUF];
+    ssize_t n;
+    sig->hash = 0xcbf29ce484222325ULL;
+    while((n = read(fd, buf, sizeof(buf))) > 0){
+        sig->hash = hashBytes(sig->hash, buf, n);
+    }
+    close(fd);
+    return (n < 0) ? -1 : 0;
+}
+
+static void readMemo(int fd, struct hashTable* memo){
+    lseek(fd, 0, SEEK_SET);     // the dup shares the offset of the last read
+    FILE* file = fdopen(dup(fd), "r");
+    if(file == NULL){
+        return;
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    while(getline(&line, &cap, file) > 0){
+        // the key is "command key<TAB>path"
+        char* rest = strchr(line, '\t');
+        rest = (rest != NULL) ? strchr(rest + 1, '\t') : NULL;
+        if(rest == NULL){
+            continue;
+        }
+        *rest++ = '\0';
+        struct fileSig sig;
+        if(sscanf(rest, "%lld\t%lld\t%" SCNx64, &sig.size, &sig.mtime, &sig.hash) != 3){
+            continue;
+        }
+        struct fileSig* copy = malloc(sizeof(sig));
+        *copy = sig;
+        free(hashPut(memo, line, copy));
+    }
+    free(line);
+    fclose(file);
+}
+
+static void writeMemo(int fd, struct hashTable* memo){
+    struct strBuf out = { NULL, 0, 0 };
+    bufAppend(&out, "", 0);
+    for(int b = 0; b < HASH_BUCKETS; b++){
+        for(struct hashEntry* entry = memo->buckets[b]; entry != NULL; entry = entry->next){
+            struct fileSig* sig = entry->value;
+            char num[96];
+            int len = snprintf(num, sizeof(num), "\t%lld\t%lld\t%016" PRIx64 "\n", sig->size, sig->mtime, sig->hash);
+            bufAppend(&out, entry->key, strlen(entry->key));
+            bufAppend(&out, num, len);
+        }
+    }
+    if(ftruncate(fd, 0) < 0 || pwrite(fd, out.data, out.len, 0) != (ssize_t)out.len){
+        perror("Shell: memo");
+    }
+    free(out.data);
+}
+
+// Copies a ring buffer input into the pipe memo's command reads
+struct inputFeed {
+    struct msh_io* io;
+    int fd;
+    pthread_t thread;
+};
+
+static void* feedInput(void* arg){
+    struct inputFeed* feed = arg;
+    struct msh_io to = { -1, feed->fd, -1, NULL, fdWrite, NULL, NULL, NULL };
+    char buf[LINE_BUF];
+    ssize_t n;
+    while((n = feed->io->read(feed->io, buf, sizeof(buf))) > 0 && fdWrite(&to, buf, n) >= 0);
+    close(feed->fd);    // EOF for the command, or it stopped reading
+    return NULL;
+}
+
+// memo [--in file...] [--out file...] -- cmd...
+// Runs cmd unless it succeeded before and none of the files changed since.
+// Files are compared by size and mtime first, their contents only when those differ
+int builtinMemo(int argc, char** argv, struct msh_io* io){
+    char** files = calloc(argc, sizeof(char*));
+    int num_files = 0;
+    int cmd = 0;
+    int listing = 0;    // after --in or --out
+
+    // the key covers the directory, command line and file lists
+    char cwd[4096];
+    if(getcwd(cwd, sizeof(cwd)) == NULL){
+        strcpy(cwd, "/");
+    }
+    uint64_t key = hashBytes(0xcbf29ce484222325ULL, cwd, strlen(cwd) + 1);
+    for(int i = 1; i < argc; i++){
+        key = hashBytes(key, argv[i], strlen(argv[i]) + 1);
+        if(strcmp(argv[i], "--") == 0){
+            cmd = i + 1;
+            for(int j = cmd; j < argc; j++){
+                key = hashBytes(key, argv[j], strlen(argv[j]) + 1);
+            }
+            break;
+        }
+        if(strcmp(argv[i], "--in") == 0 || strcmp(argv[i], "--out") == 0){
+            listing = 1;
+        }
+        else if(listing){
+            files[num_files++] = argv[i];
+        }
+        else{
+            break;
+        }
+    }
+    if(cmd == 0 || cmd >= argc){
+        printf("Shell: Incorrect command\n");
+        free(files);
+        return 2;
+    }
+
+    const char* path = getenv("MSH_MEMO");
+    if(path == NULL || *path == '\0'){
+        path = ".myshell_memo";
+    }
+    struct hashTable memo = { { NULL } };
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd >= 0){
+        flock(fd, LOCK_SH);
+        readMemo(fd, &memo);
+        flock(fd, LOCK_UN);
+    }
+
+    // up to date when it succeeded before (an entry without a path) and
+    // every file is there and looks like it did last time
+    char done[32];
+    snprintf(done, sizeof(done), "%016" PRIx64 "\t", key);
+    int up_to_date = (hashGet(&memo, done) != NULL);
+    for(int i = 0; i < num_files && up_to_date; i++){
+        char name[4096 + 32];
+        snprintf(name, sizeof(name), "%016" PRIx64 "\t%s", key, files[i]);
+        struct fileSig* known = hashGet(&memo, name);
+        struct fileSig sig;
+        up_to_date = known != NULL && fileSignature(files[i], &sig, known) == 0 && sig.hash == known->hash;
+    }
+
+    int status = 0;
+    // ring buffer ends have no fd, the command gets pipes relayed to them
+    int out_pipe[2] = { -1, -1 };
+    int in_pipe[2] = { -1, -1 };
+    if(!up_to_date && ((io->out_fd < 0 && pipe2(out_pipe, O_CLOEXEC) < 0)
+                       || (io->in_fd < 0 && pipe2(in_pipe, O_CLOEXEC) < 0))){
+        if(out_pipe[0] >= 0){
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+        }
+        status = 1;
+    }
+    else if(!up_to_date){
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid == 0){
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            int in_fd = (in_pipe[0] >= 0) ? in_pipe[0] : io->in_fd;
+            if(in_fd != STDIN_FILENO){
+                dup2(in_fd, STDIN_FILENO);
+            }
+            int out_fd = (out_pipe[1] >= 0) ? out_pipe[1] : io->out_fd;
+            if(out_fd != STDOUT_FILENO){
+                dup2(out_fd, STDOUT_FILENO);
+            }
+            execArgs(&argv[cmd]);
+        }
+        struct inputFeed feed = { io, in_pipe[1], 0 };
+        int feeding = 0;
+        if(in_pipe[0] >= 0){
+            close(in_pipe[0]);
+            feeding = (pid > 0 && pthread_create(&feed.thread, NULL, feedInput, &feed) == 0);
+            if(!feeding){
+                close(in_pipe[1]);
+            }
+        }
+        if(out_pipe[0] >= 0){
+            close(out_pipe[1]);
+            char buf[LINE_BUF];
+            ssize_t n;
+            while((n = read(out_pipe[0], buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)){
+                if(n > 0 && io->write(io, buf, n) < 0){
+                    break;
+                }
+            }
+            close(out_pipe[0]);
+        }
+        int wait_status;
+        status = (pid > 0 && waitpid(pid, &wait_status, 0) == pid) ? statusOf(wait_status) : 1;
+        if(feeding){
+            pthread_join(feed.thread, NULL);
+        }
+    }
+
+    // a failed run must not leave an older success behind
+    if(status != 0 && fd >= 0){
+        flock(fd, LOCK_EX);
+        clearTable(&memo);
+        readMemo(fd, &memo);
+        free(hashRemove(&memo, done));
+        writeMemo(fd, &memo);
+    }
+
+    // record the files as the successful run left them, merged with what
+    // other shells wrote in the meantime
+    if(status == 0 && fd >= 0){
+        flock(fd, LOCK_EX);
+        clearTable(&memo);
+        readMemo(fd, &memo);
+        struct fileSig* ran = calloc(1, sizeof(struct fileSig));
+        free(hashPut(&memo, done, ran));
+        for(int i = 0; i < num_files; i++){
+            char name[4096 + 32];
+            snprintf(name, sizeof(name), "%016" PRIx64 "\t%s", key, files[i]);
+            struct fileSig* known = hashGet(&memo, name);
+            struct fileSig* sig = malloc(sizeof(struct fileSig));
+            if(fileSignature(files[i], sig, known) < 0){
+                free(sig);
+                free(hashRemove(&memo, name));
+            }
+            else{
+                free(hashPut(&memo, name, sig));
+            }
+        }
+        writeMemo(fd, &memo);
+    }
+
+    if(fd >= 0){
+        close(fd);     // drops the lock
+    }
+    clearTable(&memo);
+    free(files);
+    return status;
+}
+
+// Copy everything from fd (read from the start) to an output
+static void replayFd(int fd, struct msh_io* to){
+    char buf[LINE_BUF];
+    ssize_t n;
+    lseek(fd, 0, SEEK_SET);
+    while((n = read(fd, buf, sizeof(buf))) > 0 && to->write(to, buf, n) >= 0);
+}
+
+// Output cache: every entry is a directory named by the hash of what the command
+// depends on, under $MSH_CACHE_DIR or else ~/.cache/myshell, with the files
+// out, err and status. Entries are built as NAME.PID.tmp and renamed in place
+static int cacheRoot(char* buf, size_t len){
+    const char* dir = getenv("MSH_CACHE_DIR");
+    const char* home = getenv("HOME");
+    int need;
+    if(dir != NULL && *dir != '\0'){
+        need = snprintf(buf, len, "%s", dir);
+    }
+    else if(home != NULL){
+        need = snprintf(buf, len, "%s/.cache/myshell", home);
+    }
+    else{
+        return -1;
+    }
+    if(need >= (int)len){
+        return -1;
+    }
+
+    // mkdir -p
+    for(char* slash = strchr(buf + 1, '/'); ; slash = strchr(slash + 1, '/')){
+        if(slash != NULL){
+            *slash = '\0';
+        }
+        int made = mkdir(buf, 0755) == 0 || errno == EEXIST;
+        if(slash == NULL){
+            return made ? 0 : -1;
+        }
+        *slash = '/';
+    }
+}
+
+static void removeEntry(const char* dir){
+    char path[4096 + 16];
+    const char* files[] = { "out", "err", "status", NULL };
+    for(int i = 0; files[i] != NULL; i++){
+        if(snprintf(path, sizeof(path), "%s/%s", dir, files[i]) < (int)sizeof(path)){
+            unlink(path);
+        }
+    }
+    rmdir(dir);
+}
+
+// Write a cached out / err file to the builtin's stdout / stderr
+static void replayFile(const char* dir, const char* name, struct msh_io* to){
+    char path[4096 + 16];
+    if(snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)){
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd >= 0){
+        replayFd(fd, to);
+        close(fd);
+    }
+}
+
+// Run the command with stdout and stderr going both to the builtin's and into
+// the entry being built. Returns its exit status
+static int runCached(char** args, int in_fd, const char* dir, struct msh_io* io){
+    struct msh_io err = { -1, io->err_fd, -1, NULL, fdWrite, NULL, NULL, NULL };
+    struct msh_io files[2] = { { -1, -1, -1, NULL, fdWrite, NULL, NULL, NULL },
+                               { -1, -1, -1, NULL, fdWrite, NULL, NULL, NULL } };
+    struct msh_io* shown[2] = { io, &err };
+    const char* names[2] = { "out", "err" };
+    int pipes[2][2];
+
+    for(int i = 0; i < 2; i++){
+        char path[4096 + 16];
+        if(snprintf(path, sizeof(path), "%s/%s", dir, names[i]) >= (int)sizeof(path)){
+            return 1;
+        }
+        files[i].out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(pipe2(pipes[i], O_CLOEXEC) < 0){
+            return 1;
+        }
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0){
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        dup2(in_fd, STDIN_FILENO);
+        dup2(pipes[0][1], STDOUT_FILENO);
+        dup2(pipes[1][1], STDERR_FILENO);
+        execArgs(args);
+    }
+    struct pollfd fds[2];
+    for(int i = 0; i < 2; i++){
+        close(pipes[i][1]);
+        fds[i].fd = pipes[i][0];
+        fds[i].events = POLLIN;
+    }
+
+    char buf[LINE_BUF];
+    while(pid > 0 && (fds[0].fd >= 0 || fds[1].fd >= 0)){
+        if(poll(fds, 2, -1) < 0 && errno != EINTR){
+            break;
+        }
+        for(int i = 0; i < 2; i++){
+            if(fds[i].fd < 0 || fds[i].revents == 0){
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if(n <= 0){
+                fds[i].fd = -1;     // ignored by poll() from now on
+                continue;
+            }
+            if(files[i].out_fd >= 0){
+                fdWrite(&files[i], buf, n);
+            }
+            shown[i]->write(shown[i], buf, n);
+        }
+    }
+
+    for(int i = 0; i < 2; i++){
+        close(pipes[i][0]);
+        if(files[i].out_fd >= 0){
+            close(files[i].out_fd);
+        }
+    }
+    int wait_status;
+    return (pid > 0 && waitpid(pid, &wait_status, 0) == pid) ? statusOf(wait_status) : 1;
+}
+
+// cache [-e NAME]... -- cmd...
+// Replays the output and exit status of an earlier run of cmd with the same
+// arguments, cwd, environment variables NAME (and those in $MSH_CACHE_ENV) and
+// stdin. Without a pipe feeding it, the command reads /dev/null
+int builtinCache(int argc, char** argv, struct msh_io* io){
+    int cmd = 0;
+    for(int i = 1; i < argc && cmd == 0; i++){
+        if(strcmp(argv[i], "--") == 0){
+            cmd = i + 1;
+        }
+        else if(strcmp(argv[i], "-e") != 0 || ++i >= argc){
+            break;
+        }
+    }
+    if(cmd == 0 || cmd >= argc){
+        printf("Shell: Incorrect command\n");
+        return 2;
+    }
+
+    char cwd[4096];
+    if(getcwd(cwd, sizeof(cwd)) == NULL){
+        strcpy(cwd, "/");
+    }
+    uint64_t key = hashBytes(0xcbf29ce484222325ULL, cwd, strlen(cwd) + 1);
+    for(int i = cmd; i < argc; i++){
+        key = hashBytes(key, argv[i], strlen(argv[i]) + 1);
+    }
+
+    // NAME=value of the chosen variables, unset ones hash as just NAME
+    char* names = strdup(getenv("MSH_CACHE_ENV") != NULL ? getenv("MSH_CACHE_ENV") : "");
+    char* rest = names;
+    char* name;
+    for(int i = 1; i < cmd - 1; i += 2){
+        const char* value = io->getenv(argv[i + 1]);
+        key = hashBytes(key, argv[i + 1], strlen(argv[i + 1]) + 1);
+        key = hashBytes(key, value != NULL ? value : "", value != NULL ? strlen(value) + 1 : 0);
+    }
+    while((name = strsep(&rest, ",")) != NULL){
+        const char* value = (*name != '\0') ? io->getenv(name) : NULL;
+        key = hashBytes(key, name, strlen(name) + 1);
+        key = hashBytes(key, value != NULL ? value : "", value != NULL ? strlen(value) + 1 : 0);
+    }
+    free(names);
+
+    // piped stdin is part of the key, so it is read up front
+    int in_fd;
+    if(io->in_fd != STDIN_FILENO){
+        in_fd = memfd_create("msh-cache-stdin", MFD_CLOEXEC);
+        struct msh_io mem = { -1, in_fd, -1, NULL, fdWrite, NULL, NULL, NULL };
+        char buf[LINE_BUF];
+        ssize_t n;
+        key = hashBytes(key, "\0stdin", 7);
+        while((n = io->read(io, buf, sizeof(buf))) > 0){
+            key = hashBytes(key, buf, n);
+            fdWrite(&mem, buf, n);
+        }
+        lseek(in_fd, 0, SEEK_SET);
+    }
+    else{
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    char root[4096], dir[4096 + 64], tmp[4096 + 96];
+    if(cacheRoot(root, sizeof(root)) < 0){
+        printf("Shell: cache: no cache directory\n");
+        close(in_fd);
+        return 1;
+    }
+    // the entry's files must fit the fixed path buffers
+    char path[4096 + 128];
+    if(snprintf(dir, sizeof(dir), "%s/%016" PRIx64, root, key) >= (int)sizeof(dir)
+       || snprintf(tmp, sizeof(tmp), "%s.%d.tmp", dir, (int)getpid()) >= (int)sizeof(tmp)
+       || snprintf(path, sizeof(path), "%s/status", tmp) >= (int)sizeof(path)){
+        printf("Shell: cache: path too long\n");
+        close(in_fd);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/status", dir);
+    FILE* file = fopen(path, "r");
+    int status;
+    if(file != NULL && fscanf(file, "%d", &status) == 1){
+        struct msh_io err = { -1, io->err_fd, -1, NULL, fdWrite, NULL, NULL, NULL };
+        fclose(file);
+        close(in_fd);
+        replayFile(dir, "out", io);
+        replayFile(dir, "err", &err);
+        return status;
+    }
+    if(file != NULL){
+        fclose(file);
+    }
+
+    mkdir(tmp, 0755);
+    status = runCached(&argv[cmd], in_fd, tmp, io);
+    close(in_fd);
+
+    // a run killed by a signal says nothing about the command
+    snprintf(path, sizeof(path), "%s/status", tmp);
+    file = (status < 128) ? fopen(path, "w") : NULL;
+    if(file != NULL){
+        fprintf(file, "%d\n", status);
+        fclose(file);
+        if(rename(tmp, dir) == 0){
+            return status;
+        }
+    }
+    removeEntry(tmp);   // failed, or another shell stored it first
+    return status;
+}
+
+// Execute multiple commands with tags, options, args sequentially  (no limits specified)
+void executeSequentialCommands(char* input_str){
+    char* command;
+
+    // MSH_AUTOPAR=N runs independent steps N at a time, unless one changes the shell
+    const char* autopar = getenv("MSH_AUTOPAR");
+    if(autopar != NULL && atoi(autopar) > 0 && !listChangesState(input_str)){
+        executeParallelSteps(input_str, atoi(autopar));
+        return;
+    }
+
+    // split input on "##"
+    while((command = strsep(&input_str, "##")) != NULL){
+        command = trimStr(command);
+        if(*command == '\0'){
+            continue;
+        }
+        if(strpbrk(command, "<>") != NULL){
+            executeCommandRedirection(command);
+            continue;
+        }
+        char* args[MAX_ARGS];
+        parseInput(command, args);
+        executeCommand(args);   // cd is a builtin and runs in the shell
+    }
+}
+
+// Files a ## step reads and writes. Only a memo step declares them (--in, --out),
+// with its > target as one more output; any other step is a barrier
+struct stepFiles {
+    char* copy;
+    char* reads[MAX_ARGS];
+    int num_reads;
+    char* writes[MAX_ARGS + 1];
+    int num_writes;
+    int declared;
+};
+
+static void readStepFiles(const char* step, struct stepFiles* files){
+    memset(files, 0, sizeof(*files));
+    files->copy = strdup(step);
+
+    char* target = strchr(files->copy, '>');
+    if(target != NULL){
+        *target = '\0';
+        files->writes[files->num_writes++] = trimStr(target + 1);
+    }
+
+    char* args[MAX_ARGS];
+    parseInput(files->copy, args);
+    if(args[0] == NULL || strcmp(args[0], "memo") != 0){
+        return;
+    }
+    char** list = NULL;
+    int* count = NULL;
+    for(int i = 1; args[i] != NULL && strcmp(args[i], "--") != 0; i++){
+        if(strcmp(args[i], "--in") == 0){
+            list = files->reads;
+            count = &files->num_reads;
+        }
+        else if(strcmp(args[i], "--out") == 0){
+            list = files->writes;
+            count = &files->num_writes;
+        }
+        else if(list != NULL){
+            list[(*count)++] = args[i];
+        }
+    }
+    files->declared = 1;
+}
+
+static int sharesFile(char** a, int num_a, char** b, int num_b){
+    for(int i = 0; i < num_a; i++){
+        for(int j = 0; j < num_b; j++){
+            if(strcmp(a[i], b[j]) == 0){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Scheduler hook: write out the captured output of every finished step in step order
+static void replaySteps(struct scheduler* sched, struct job* job){
+    (void)job;
+    int* next = sched->data;
+    struct msh_io out = { -1, STDOUT_FILENO, -1, NULL, fdWrite, NULL, NULL, NULL };
+    struct msh_io err = { -1, STDERR_FILENO, -1, NULL, fdWrite, NULL, NULL, NULL };
+
+    while(*next < sched->num_jobs && sched->jobs[*next].state != JOB_QUEUED && sched->jobs[*next].state != JOB_RUNNING){
+        struct job* done = &sched->jobs[*next];
+        fflush(stdout);
+        replayFd(done->out_fd, &out);
+        replayFd(done->err_fd, &err);
+        close(done->out_fd);
+        close(done->err_fd);
+        (*next)++;
+    }
+}
+
+// Run the steps of a ## sequence on the scheduler: a step waits for the last
+// barrier and for earlier steps whose files it reads or writes, or that read what
+// it writes. Output is captured and shown in step order, $? is the last step's
+void executeParallelSteps(char* input_str, int slots){
+    int num = 0;
+    struct job* jobs = calloc(strlen(input_str) / 2 + 1, sizeof(struct job));
+    char* command;
+    while((command = strsep(&input_str, "##")) != NULL){
+        command = trimStr(command);
+        if(*command != '\0'){
+            jobs[num++].cmd = command;
+        }
+    }
+
+    struct stepFiles* files = malloc(sizeof(struct stepFiles) * (num + 1));
+    int barrier = -1;
+    for(int i = 0; i < num; i++){
+        readStepFiles(jobs[i].cmd, &files[i]);
+        for(int j = (barrier < 0) ? 0 : barrier; j < i; j++){
+            if(j == barrier || !files[i].declared
+               || sharesFile(files[j].writes, files[j].num_writes, files[i].reads, files[i].num_reads)
+               || sharesFile(files[j].writes, files[j].num_writes, files[i].writes, files[i].num_writes)
+               || sharesFile(files[j].reads, files[j].num_reads, files[i].writes, files[i].num_writes)){
+                addDependency(jobs, j, i);
+            }
+        }
+        if(!files[i].declared){
+            barrier = i;
+        }
+    }
+
+    struct scheduler sched;
+    int next = 0;
+    initScheduler(&sched, jobs, num, slots);
+    for(int i = 0; i < num; i++){
+        jobs[i].out_fd = memfd_create("msh-step-out", MFD_CLOEXEC);
+        jobs[i].err_fd = memfd_create("msh-step-err", MFD_CLOEXEC);
+    }
+    sched.keep_going = 1;
+    sched.finished = replaySteps;
+    sched.data = &next;
+    runScheduler(&sched);
+    freeScheduler(&sched);
+
+    last_status = (num > 0) ? jobs[num - 1].status : 0;
+    for(int i = 0; i < num; i++){
+        free(files[i].copy);
+        free(jobs[i].dependents);
+    }
+    free(files);
+    free(jobs);
+}
+
+// Target of a redirection, "file" or "{option,option=value...} file".
+// prealloc=SIZE   fallocate SIZE bytes (K, M, G suffixes) up front, the file keeps its size
+// direct          the shell writes the file with O_DIRECT from aligned buffers, so the
+//                 output doesn't push everything else out of the page cache
+// sum=ALG         crc32c or xxh64 of the data, count / lines: bytes (and lines) of it,
+//                 shown on stderr once the command is done
+// gz / z before the options pick a codec, see executeCommandRedirection
+enum { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD };
+enum { SUM_NONE, SUM_CRC32C, SUM_XXH64 };
+
+struct redirect {
+    char* path;
+    long long prealloc;
+    int direct;
+    int codec;
+    int level;              // level=N, 0 for the codec's default
+    int threads;            // threads=N, zstd compression workers
+    int sum;                // sum=crc32c / sum=xxh64, reported after the command
+    int count;              // count: bytes, lines: bytes and lines
+    int lines;
+};
+
+static long long parseSize(const char* text){
+    char* end;
+    long long size = strtoll(text, &end, 10);
+    switch(toupper((unsigned char)*end)){
+        case 'K': return size << 10;
+        case 'M': return size << 20;
+        case 'G': return size << 30;
+        case 'T': return size << 40;
+        case '\0': return size;
+    }
+    return -1;
+}
+
+// Returns -1 on an unknown option
+static int parseRedirect(char* target, struct redirect* redir){
+    memset(redir, 0, sizeof(*redir));
+    target = trimStr(target);
+    // >gz file, >z{level=9} file, but >zfile is a file named zfile
+    if(strncmp(target, "gz", 2) == 0 && (isspace((unsigned char)target[2]) || target[2] == '{')){
+        redir->codec = CODEC_GZIP;
+        target = trimStr(target + 2);
+    }
+    else if(target[0] == 'z' && (isspace((unsigned char)target[1]) || target[1] == '{')){
+        redir->codec = CODEC_ZSTD;
+        target = trimStr(target + 1);
+    }
+    if(*target != '{'){
+        redir->path = target;
+        return (*target != '\0') ? 0 : -1;
+    }
+
+    char* close_brace = strchr(target, '}');
+    if(close_brace == NULL){
+        return -1;
+    }
+    *close_brace = '\0';
+    redir->path = trimStr(close_brace + 1);
+
+    char* rest = target + 1;
+    char* option;
+    while((option = strsep(&rest, ",")) != NULL){
+        option = trimStr(option);
+        if(strncmp(option, "prealloc=", 9) == 0 && (redir->prealloc = parseSize(option + 9)) > 0){
+            continue;
+        }
+        if(strcmp(option, "direct") == 0){
+            redir->direct = 1;
+            continue;
+        }
+        if(strncmp(option, "level=", 6) == 0 && (redir->level = atoi(option + 6)) > 0){
+            continue;
+        }
+        if(strncmp(option, "threads=", 8) == 0 && (redir->threads = atoi(option + 8)) > 0){
+            continue;
+        }
+        if(strcmp(option, "sum=crc32c") == 0 || strcmp(option, "sum=xxh64") == 0){
+            redir->sum = (option[4] == 'c') ? SUM_CRC32C : SUM_XXH64;
+            continue;
+        }
+        if(strcmp(option, "count") == 0 || strcmp(option, "lines") == 0){
+            redir->count = 1;
+            redir->lines |= (option[0] == 'l');
+            continue;
+        }
+        if(*option != '\0'){
+            return -1;
+        }
+    }
+    return (*redir->path != '\0') ? 0 : -1;
+}
+
+// Open (and truncate) the target and reserve its space
+static int openRedirect(struct redirect* redir, int flags){
+    int fd = open(redir->path, O_WRONLY | O_CREAT | O_TRUNC | flags, 0644);
+    if(fd >= 0 && redir->prealloc > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, redir->prealloc) < 0){
+        perror("Shell: prealloc");     // not supported here, the writes still work
+    }
+    return fd;
+}
+
+// Give back the part of a prealloc the output didn't reach, the blocks past EOF
+// go when the file is truncated to its own size
+static void releasePrealloc(struct redirect* redir){
+    struct stat st;
+    int fd = open(redir->path, O_WRONLY | O_CLOEXEC);
+    if(fd < 0){
+        return;
+    }
+    if(fstat(fd, &st) == 0 && st.st_size < redir->prealloc && ftruncate(fd, st.st_size) < 0){
+        perror("Shell: prealloc");
+    }
+    close(fd);
+}
+
+#define DIRECT_ALIGN 4096           // O_DIRECT offset / length / buffer alignment
+#define DIRECT_BUF (4 << 20)        // bytes per O_DIRECT write
+
+struct directWriter {
+    int in_fd;              // pipe from the command
+    int out_fd;
+    int direct;             // 0: O_DIRECT refused by the file system, drop written pages instead
+    off_t written;
+    pthread_t thread;
+};
+
+static int writeFull(int fd, const char* buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Fill an aligned buffer from the pipe and write it out whole. The unaligned
+// tail is written with O_DIRECT switched off. The writer owns the command's end
+// of the pipe, once a write fails closing it gets the command EPIPE
+static void* runDirectWriter(void* arg){
+    struct directWriter* writer = arg;
+    char* buf;
+    if(posix_memalign((void**)&buf, DIRECT_ALIGN, DIRECT_BUF) != 0){
+        // no aligned buffer, still drain the command into the file, unaligned
+        char small[LINE_BUF];
+        ssize_t n;
+        perror("Shell: direct write");
+        fcntl(writer->out_fd, F_SETFL, fcntl(writer->out_fd, F_GETFL) & ~O_DIRECT);
+        while((n = read(writer->in_fd, small, sizeof(small))) > 0 || (n < 0 && errno == EINTR)){
+            if(n > 0 && writeFull(writer->out_fd, small, n) < 0){
+                perror("Shell: direct write");
+                break;
+            }
+        }
+        close(writer->in_fd);
+        return NULL;
+    }
+
+    size_t fill = 0;
+    ssize_t n = 1;
+    while(n > 0){
+        n = read(writer->in_fd, buf + fill, DIRECT_BUF - fill);
+        if(n < 0 && errno == EINTR){
+            n = 1;
+            continue;
+        }
+        fill += (n > 0) ? n : 0;
+        if(fill < DIRECT_BUF && n > 0){
+            continue;
+        }
+
+        size_t whole = fill & ~(size_t)(DIRECT_ALIGN - 1);
+        if(whole > 0 && writeFull(writer->out_fd, buf, whole) < 0){
+            perror("Shell: direct write");
+            fill = 0;       // nothing more goes to the file
+            break;
+        }
+        if(!writer->direct && whole > 0){
+            sync_file_range(writer->out_fd, writer->written, whole,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(writer->out_fd, writer->written, whole, POSIX_FADV_DONTNEED);
+        }
+        writer->written += whole;
+        memmove(buf, buf + whole, fill - whole);
+        fill -= whole;
+    }
+
+    if(fill > 0){
+        fcntl(writer->out_fd, F_SETFL, fcntl(writer->out_fd, F_GETFL) & ~O_DIRECT);
+        if(writeFull(writer->out_fd, buf, fill) < 0){
+            perror("Shell: direct write");
+        }
+        else{
+            writer->written += fill;
+        }
+    }
+    close(writer->in_fd);
+    // drop what was reserved but not used, only a regular file has any
+    struct stat st;
+    if(fstat(writer->out_fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(writer->out_fd, writer->written) < 0){
+        perror("Shell: direct write");
+    }
+    free(buf);
+    return NULL;
+}
+
+// Checksums for {sum=crc32c} / {sum=xxh64} redirections
+static uint32_t crc32c_table[256];
+
+static void crc32cInit(void){
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+#if defined(__x86_64__)
+// the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t len){
+    uint64_t crc64 = crc;
+    for(; len >= 8; data += 8, len -= 8){
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = crc64;
+    for(; len > 0; data++, len--){
+        crc = __builtin_ia32_crc32qi(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+// crc is the running value, start with 0
+static uint32_t crc32c(uint32_t crc, const void* buf, size_t len){
+    static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+    const unsigned char* data = buf;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("sse4.2")){
+        return ~crc32cHardware(crc, data, len);
+    }
+#endif
+    pthread_once(&table_once, crc32cInit);
+    for(; len > 0; data++, len--){
+        crc = crc32c_table[(crc ^ *data) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+// Streaming XXH64 with seed 0
+struct xxh64 {
+    uint64_t acc[4];
+    uint64_t total;
+    unsigned char stripe[32];   // bytes short of a whole stripe
+    size_t fill;
+};
+
+static uint64_t xxhRotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input){
+    return xxhRotl(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64_t xxhRead64(const unsigned char* p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void xxh64Init(struct xxh64* state){
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = XXH_P1 + XXH_P2;
+    state->acc[1] = XXH_P2;
+    state->acc[3] = -XXH_P1;
+}
+
+static void xxh64Update(struct xxh64* state, const void* buf, size_t len){
+    const unsigned char* data = buf;
+    state->total += len;
+    if(state->fill + len < 32){
+        memcpy(state->stripe + state->fill, data, len);
+        state->fill += len;
+        return;
+    }
+    if(state->fill > 0){
+        size_t take = 32 - state->fill;
+        memcpy(state->stripe + state->fill, data, take);
+        for(int i = 0; i < 4; i++){
+            state->acc[i] = xxhRound(state->acc[i], xxhRead64(state->stripe + i * 8));
+        }
+        data += take;
+        len -= take;
+        state->fill = 0;
+    }
+    for(; len >= 32; data += 32, len -= 32){
+        for(int i = 0; i < 4; i++){
+            state->acc[i] = xxhRound(state->acc[i], xxhRead64(data + i * 8));
+        }
+    }
+    memcpy(state->stripe, data, len);
+    state->fill = len;
+}
+
+static uint64_t xxh64Digest(const struct xxh64* state){
+    uint64_t hash;
+    if(state->total >= 32){
+        hash = xxhRotl(state->acc[0], 1) + xxhRotl(state->acc[1], 7) + xxhRotl(state->acc[2], 12) + xxhRotl(state->acc[3], 18);
+        for(int i = 0; i < 4; i++){
+            hash = (hash ^ xxhRound(0, state->acc[i])) * XXH_P1 + XXH_P4;
+        }
+    }
+    else{
+        hash = XXH_P5;
+    }
+    hash += state->total;
+
+    const unsigned char* p = state->stripe;
+    size_t len = state->fill;
+    for(; len >= 8; p += 8, len -= 8){
+        hash = xxhRotl(hash ^ xxhRound(0, xxhRead64(p)), 27) * XXH_P1 + XXH_P4;
+    }
+    if(len >= 4){
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        hash = xxhRotl(hash ^ (word * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for(; len > 0; p++, len--){
+        hash = xxhRotl(hash ^ (*p * XXH_P5), 11) * XXH_P1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_P2;
+    hash ^= hash >> 29;
+    hash *= XXH_P3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Compressed and checked redirection. A shell thread sits between the file and a
+// pipe to the command, so a codec works on its own core while the command runs.
+// zlib and zstd are loaded when first needed, nothing has to be linked in
+struct fileRelay {
+    struct redirect* redir;
+    int output;             // 1: in_fd is the command's output, 0: out_fd is the command's input
+    int in_fd;
+    int out_fd;
+    pthread_t thread;
+    int failed;             // the totals below don't cover everything
+
+    // what went through, for sum= / count / lines
+    long long bytes;
+    long long lines;
+    uint32_t crc;
+    struct xxh64 xxh;
+};
+
+// The stable part of the zstd streaming API
+struct zstdInBuf { const void* src; size_t size; size_t pos; };
+struct zstdOutBuf { void* dst; size_t size; size_t pos; };
+#define ZSTD_C_LEVEL 100
+#define ZSTD_C_WORKERS 400
+#define ZSTD_E_CONTINUE 0
+#define ZSTD_E_END 2
+
+struct zstdApi {
+    void* (*createCCtx)(void);
+    size_t (*setParameter)(void* cctx, int param, int value);
+    size_t (*compressStream2)(void* cctx, struct zstdOutBuf* out, struct zstdInBuf* in, int end);
+    size_t (*freeCCtx)(void* cctx);
+    void* (*createDCtx)(void);
+    size_t (*decompressStream)(void* dctx, struct zstdOutBuf* out, struct zstdInBuf* in);
+    size_t (*freeDCtx)(void* dctx);
+    unsigned (*isError)(size_t code);
+};
+
+// Resolve every symbol of a library into a struct of function pointers, NULL when missing
+static void* loadCodec(const char* lib, const char** names, void** fns, int num){
+    void* handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+    for(int i = 0; handle != NULL && i < num; i++){
+        if((fns[i] = dlsym(handle, names[i])) == NULL){
+            dlclose(handle);
+            handle = NULL;
+        }
+    }
+    if(handle == NULL){
+        printf("Shell: %s not available\n", lib);
+    }
+    return handle;
+}
+
+static struct zstdApi* zstdLib(void){
+    static struct zstdApi api;
+    static void* handle;
+    static const char* names[] = { "ZSTD_createCCtx", "ZSTD_CCtx_setParameter", "ZSTD_compressStream2", "ZSTD_freeCCtx",
+                                   "ZSTD_createDCtx", "ZSTD_decompressStream", "ZSTD_freeDCtx", "ZSTD_isError" };
+    if(handle == NULL){
+        handle = loadCodec("libzstd.so.1", names, (void**)&api, 8);
+    }
+    return (handle != NULL) ? &api : NULL;
+}
+
+static int zstdRelay(struct fileRelay* relay){
+    struct zstdApi* zstd = zstdLib();
+    if(zstd == NULL){
+        return -1;
+    }
+    char* in_buf = malloc(LINE_BUF * 2);
+    char* out_buf = in_buf + LINE_BUF;
+    void* ctx = relay->output ? zstd->createCCtx() : zstd->createDCtx();
+    if(relay->output){
+        zstd->setParameter(ctx, ZSTD_C_LEVEL, relay->redir->level > 0 ? relay->redir->level : 3);
+        zstd->setParameter(ctx, ZSTD_C_WORKERS, relay->redir->threads);     // an error without multithreading, then 1 thread
+    }
+
+    int failed = 0;
+    for(;;){
+        ssize_t n = read(relay->in_fd, in_buf, LINE_BUF);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        struct zstdInBuf in = { in_buf, (n > 0) ? n : 0, 0 };
+        int end = (n <= 0) ? ZSTD_E_END : ZSTD_E_CONTINUE;
+        int more;
+        do{
+            struct zstdOutBuf out = { out_buf, LINE_BUF, 0 };
+            size_t ret = relay->output ? zstd->compressStream2(ctx, &out, &in, end) : zstd->decompressStream(ctx, &out, &in);
+            if(zstd->isError(ret) || writeFull(relay->out_fd, out_buf, out.pos) < 0){
+                failed = 1;
+                break;
+            }
+            // input left, output that didn't fit, or (when ending) bytes still to flush
+            more = in.pos < in.size || out.pos == out.size || (relay->output && end == ZSTD_E_END && ret != 0);
+        } while(more);
+        if(failed || n <= 0){
+            failed |= (n < 0);
+            break;
+        }
+    }
+
+    relay->output ? zstd->freeCCtx(ctx) : zstd->freeDCtx(ctx);
+    free(in_buf);
+    return failed ? -1 : 0;
+}
+
+#ifdef HAVE_ZLIB
+struct zlibApi {
+    int (*deflateInit2_)(z_stream* strm, int level, int method, int bits, int mem, int strategy, const char* version, int size);
+    int (*deflate)(z_stream* strm, int flush);
+    int (*deflateEnd)(z_stream* strm);
+    int (*inflateInit2_)(z_stream* strm, int bits, const char* version, int size);
+    int (*inflate)(z_stream* strm, int flush);
+    int (*inflateReset)(z_stream* strm);
+    int (*inflateEnd)(z_stream* strm);
+};
+
+static struct zlibApi* zlibLib(void){
+    static struct zlibApi api;
+    static void* handle;
+    static const char* names[] = { "deflateInit2_", "deflate", "deflateEnd", "inflateInit2_", "inflate", "inflateReset", "inflateEnd" };
+    if(handle == NULL){
+        handle = loadCodec("libz.so.1", names, (void**)&api, 7);
+    }
+    return (handle != NULL) ? &api : NULL;
+}
+
+static int gzipRelay(struct fileRelay* relay){
+    struct zlibApi* zlib = zlibLib();
+    if(zlib == NULL){
+        return -1;
+    }
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // 16 + 15: gzip header, 32 + 15: gzip or zlib, detected
+    int ret = relay->output
+            ? zlib->deflateInit2_(&strm, relay->redir->level > 0 ? relay->redir->level : Z_DEFAULT_COMPRESSION,
+                                  Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY, ZLIB_VERSION, sizeof(strm))
+            : zlib->inflateInit2_(&strm, 32 + 15, ZLIB_VERSION, sizeof(strm));
+    if(ret != Z_OK){
+        return -1;
+    }
+
+    char* in_buf = malloc(LINE_BUF * 2);
+    char* out_buf = in_buf + LINE_BUF;
+    int failed = 0;
+    int ended = 0;      // inflate saw the end of the stream, else it was cut short
+    ssize_t n;
+    do{
+        while((n = read(relay->in_fd, in_buf, LINE_BUF)) < 0 && errno == EINTR);
+        strm.next_in = (Bytef*)in_buf;
+        strm.avail_in = (n > 0) ? n : 0;
+        int flush = (n <= 0) ? Z_FINISH : Z_NO_FLUSH;
+        do{
+            strm.next_out = (Bytef*)out_buf;
+            strm.avail_out = LINE_BUF;
+            ret = relay->output ? zlib->deflate(&strm, flush) : zlib->inflate(&strm, Z_NO_FLUSH);
+            if(ret == Z_STREAM_ERROR || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR
+               || writeFull(relay->out_fd, out_buf, LINE_BUF - strm.avail_out) < 0){
+                failed = 1;
+                break;
+            }
+            ended = (ret == Z_STREAM_END);
+            if(!relay->output && ret == Z_STREAM_END && strm.avail_in > 0){
+                zlib->inflateReset(&strm);  // another gzip member follows
+            }
+        } while(strm.avail_out == 0 || strm.avail_in > 0);
+    } while(!failed && n > 0);
+    if(!relay->output && !failed && !ended){
+        errno = EIO;
+        failed = 1;
+    }
+
+    relay->output ? zlib->deflateEnd(&strm) : zlib->inflateEnd(&strm);
+    free(in_buf);
+    return failed ? -1 : 0;
+}
+#endif
+
+#define TAP_CHUNK (1 << 20)     // bytes moved per splice()
+
+// Count, and hash when asked, what moves between the command and the file.
+// Counting bytes alone never copies the data: splice() moves it pipe -> file,
+// or file -> pipe. For lines or a checksum the output is tee()d into a side
+// pipe first, the copy read from there is all that reaches user space
+static int tapRelay(struct fileRelay* relay){
+    struct redirect* redir = relay->redir;
+    int look = (redir->sum != SUM_NONE || redir->lines);
+    // on an early failure the caller still closes the command's end of the
+    // pipe, so the command gets EPIPE / EOF rather than waiting on us
+    char* buf = look ? malloc(TAP_CHUNK) : NULL;
+    int side[2] = { -1, -1 };
+    if(look && buf == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    if(look && relay->output && pipe2(side, O_CLOEXEC) < 0){
+        free(buf);
+        return -1;
+    }
+    if(side[1] >= 0){
+        fcntl(side[1], F_SETPIPE_SZ, TAP_CHUNK);
+    }
+
+    int failed = 0;
+    for(;;){
+        ssize_t n;
+        if(!look){
+            n = splice(relay->in_fd, NULL, relay->out_fd, NULL, TAP_CHUNK, SPLICE_F_MOVE);
+        }
+        else if(relay->output){
+            n = tee(relay->in_fd, side[1], TAP_CHUNK, 0);
+            for(ssize_t got = 0, r; n > 0 && got < n; got += r){
+                if((r = read(side[0], buf + got, n - got)) <= 0){
+                    n = -1;
+                    break;
+                }
+            }
+            for(ssize_t moved = 0, r; n > 0 && moved < n; moved += r){
+                if((r = splice(relay->in_fd, NULL, relay->out_fd, NULL, n - moved, SPLICE_F_MOVE)) <= 0){
+                    n = -1;
+                    break;
+                }
+            }
+        }
+        else{
+            n = read(relay->in_fd, buf, TAP_CHUNK);
+            if(n > 0 && writeFull(relay->out_fd, buf, n) < 0){
+                n = -1;
+            }
+        }
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            failed = (n < 0);
+            break;
+        }
+
+        relay->bytes += n;
+        if(redir->lines){
+            for(char* p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++){
+                relay->lines++;
+            }
+        }
+        if(redir->sum == SUM_CRC32C){
+            relay->crc = crc32c(relay->crc, buf, n);
+        }
+        else if(redir->sum == SUM_XXH64){
+            xxh64Update(&relay->xxh, buf, n);
+        }
+    }
+
+    if(side[0] >= 0){
+        close(side[0]);
+        close(side[1]);
+    }
+    free(buf);
+    return failed ? -1 : 0;
+}
+
+// "file: N bytes, N lines, crc32c 1a2b3c4d" on stderr
+static void reportTap(struct fileRelay* relay){
+    struct redirect* redir = relay->redir;
+    char line[4096 + 128];
+    int len = snprintf(line, sizeof(line), "%s:", redir->path);
+    if(redir->count){
+        len += snprintf(line + len, sizeof(line) - len, " %lld bytes%s", relay->bytes, redir->lines ? "," : "");
+    }
+    if(redir->lines){
+        len += snprintf(line + len, sizeof(line) - len, " %lld lines", relay->lines);
+    }
+    if(redir->sum == SUM_CRC32C){
+        len += snprintf(line + len, sizeof(line) - len, "%s crc32c %08x", redir->count ? "," : "", relay->crc);
+    }
+    else if(redir->sum == SUM_XXH64){
+        len += snprintf(line + len, sizeof(line) - len, "%s xxh64 %016" PRIx64, redir->count ? "," : "", xxh64Digest(&relay->xxh));
+    }
+    len += snprintf(line + len, sizeof(line) - len, "\n");
+    fflush(stdout);
+    if(write(STDERR_FILENO, line, len) < 0){
+        perror("Shell: redirection");
+    }
+}
+
+// A codec that can't be loaded is reported before the command is started
+static int codecAvailable(int codec){
+    if(codec == CODEC_ZSTD){
+        return zstdLib() != NULL;
+    }
+    if(codec == CODEC_GZIP){
+#ifdef HAVE_ZLIB
+        return zlibLib() != NULL;
+#else
+        printf("Shell: built without zlib\n");
+        return 0;
+#endif
+    }
+    return 1;
+}
+
+// The relay owns the command's end of the pipe: closing it when done, also on
+// a failure, lets the command see EOF or EPIPE instead of blocking forever
+static void* runFileRelay(void* arg){
+    struct fileRelay* relay = arg;
+    int codec = relay->redir->codec;
+    int ret = -1;
+
+    if(codec == CODEC_NONE){
+        // EPIPE is an input the command stopped reading, the totals still hold
+        if(tapRelay(relay) < 0 && errno != EPIPE){
+            relay->failed = 1;
+            printf("Shell: %s: %s\n", relay->redir->path, strerror(errno));
+        }
+        close(relay->output ? relay->in_fd : relay->out_fd);
+        return NULL;
+    }
+
+    // input is recognized by its magic number, anything else is passed through
+    if(!relay->output){
+        unsigned char magic[4] = { 0 };
+        if(pread(relay->in_fd, magic, sizeof(magic), 0) < 0){
+            magic[0] = 0;
+        }
+        codec = (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) ? CODEC_ZSTD
+              : (magic[0] == 0x1f && magic[1] == 0x8b) ? CODEC_GZIP : CODEC_NONE;
+    }
+    if(codec == CODEC_ZSTD){
+        ret = zstdRelay(relay);
+    }
+#ifdef HAVE_ZLIB
+    else if(codec == CODEC_GZIP){
+        ret = gzipRelay(relay);
+    }
+#endif
+    else if(codec == CODEC_NONE){
+        char buf[LINE_BUF];
+        ssize_t n;
+        while((n = read(relay->in_fd, buf, sizeof(buf))) > 0 && writeFull(relay->out_fd, buf, n) == 0);
+        ret = (n < 0) ? -1 : 0;
+    }
+    if(ret < 0 && errno != EPIPE){
+        printf("Shell: %s: %s failed\n", relay->redir->path, relay->output ? "compression" : "decompression");
+    }
+
+    close(relay->output ? relay->in_fd : relay->out_fd);
+    return NULL;
+}
+
+static void closeFd(int* fd){
+    if(*fd >= 0){
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+// Executes a single command having tags, options, args with its output redirected to a file.
+// cmd [< file] [> file], where <z file decompresses gzip / zstd input and
+// >gz file, >z file compress the output (>z{level=19,threads=4} file), and
+// >{sum=crc32c,lines} file / <{count} file report what went through
+void executeCommandRedirection(char* input_str){
+    char* command = input_str;
+    char* target = NULL;
+    char* source = NULL;
+
+    // Split input on the ">" and "<" characters
+    for(char* p = input_str; *p != '\0'; p++){
+        if(*p == '>'){
+            target = p + 1;
+            *p = '\0';
+        }
+        else if(*p == '<'){
+            source = p + 1;
+            *p = '\0';
+        }
+    }
+
+    command = trimStr(command);
+    struct redirect redir, input;
+
+    if(*command == '\0' || (target == NULL && source == NULL)
+       || (target != NULL && parseRedirect(target, &redir) < 0)
+       || (source != NULL && (parseRedirect(source, &input) < 0 || input.prealloc > 0 || input.direct))
+       || (target != NULL && redir.direct && (redir.codec != CODEC_NONE || redir.sum != SUM_NONE || redir.count))
+       || (target != NULL && redir.codec != CODEC_NONE && (redir.sum != SUM_NONE || redir.count))
+       || (source != NULL && input.codec != CODEC_NONE && (input.sum != SUM_NONE || input.count))){
+        printf("Shell: Incorrect command\n");
+        return;
+    }
+    int direct = (target != NULL && redir.direct);
+    int relay_out = (target != NULL && (redir.codec != CODEC_NONE || redir.sum != SUM_NONE || redir.count));
+    int relay_in = (source != NULL && (input.codec != CODEC_NONE || input.sum != SUM_NONE || input.count));
+
+    char* args[MAX_ARGS];
+    parseInput(command, args);
+    if(args[0] == NULL){
+        printf("Shell: Incorrect command\n");
+        return;
+    }
+    resolveCommand(args[0]);
+
+    // with direct or a codec the shell opens the file and a thread of its own
+    // moves the data between it and a pipe to the command
+    struct directWriter writer = { -1, -1, 1, 0, 0 };
+    struct fileRelay relays[2] = { { .redir = &redir, .output = 1, .in_fd = -1, .out_fd = -1 },
+                                   { .redir = &input, .output = 0, .in_fd = -1, .out_fd = -1 } };
+    xxh64Init(&relays[0].xxh);
+    xxh64Init(&relays[1].xxh);
+    int out_pipe[2] = { -1, -1 };
+    int in_pipe[2] = { -1, -1 };
+    int failed = 0;
+    if(direct){
+        writer.out_fd = openRedirect(&redir, O_CLOEXEC | O_DIRECT);
+        if(writer.out_fd < 0 && errno == EINVAL){
+            writer.direct = 0;
+            writer.out_fd = openRedirect(&redir, O_CLOEXEC);
+        }
+        failed = writer.out_fd < 0 || pipe2(out_pipe, O_CLOEXEC) < 0;
+        writer.in_fd = out_pipe[0];
+    }
+    else if(relay_out){
+        if(!codecAvailable(redir.codec)){
+            last_status = 1;
+            return;
+        }
+        relays[0].out_fd = openRedirect(&redir, O_CLOEXEC);
+        failed = relays[0].out_fd < 0 || pipe2(out_pipe, O_CLOEXEC) < 0;
+        relays[0].in_fd = out_pipe[0];
+    }
+    if(relay_in && !failed){
+        relays[1].in_fd = open(input.path, O_RDONLY | O_CLOEXEC);
+        failed = relays[1].in_fd < 0 || pipe2(in_pipe, O_CLOEXEC) < 0;
+        relays[1].out_fd = in_pipe[1];
+    }
+    if(out_pipe[1] >= 0){
+        fcntl(out_pipe[1], F_SETPIPE_SZ, 1 << 20);     // fewer wakeups, best effort
+    }
+
+    // Forking a child process
+    fflush(stdout);
+    pid_t pid = failed ? -1 : fork();
+
+    if(pid < 0){
+        printf("Shell: Incorrect command\n");
+        last_status = 1;
+    }
+    else if(pid == 0){
+        // Child process
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+
+        // open file for write only, create if it doesnt exist, and truncate it
+        int out_fd = (target == NULL) ? STDOUT_FILENO : (out_pipe[1] >= 0) ? out_pipe[1] : openRedirect(&redir, 0);
+        int in_fd = (source == NULL) ? STDIN_FILENO : (in_pipe[0] >= 0) ? in_pipe[0] : open(input.path, O_RDONLY);
+
+        if(out_fd < 0 || in_fd < 0){
+            printf("Shell: Incorrect command\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // redirect standard output to file, standard input from one
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(in_fd, STDIN_FILENO);
+
+        execArgs(args);
+    }
+    else{
+        // only the command keeps its ends of the pipes
+        closeFd(&out_pipe[1]);
+        closeFd(&in_pipe[0]);
+        if(direct){
+            pthread_create(&writer.thread, NULL, runDirectWriter, &writer);
+            out_pipe[0] = -1;   // closed by the writer when it is done
+        }
+        if(relay_out){
+            pthread_create(&relays[0].thread, NULL, runFileRelay, &relays[0]);
+            out_pipe[0] = -1;   // closed by the relay when it is done
+        }
+        if(relay_in){
+            pthread_create(&relays[1].thread, NULL, runFileRelay, &relays[1]);
+            in_pipe[1] = -1;    // closed by the relay when it is done
+        }
+        int status;
+        waitpid(pid, &status, WUNTRACED);
+        last_status = statusOf(status);
+
+        if(direct){
+            pthread_join(writer.thread, NULL);
+        }
+        for(int i = 0; i < 2; i++){
+            if((i == 0) ? relay_out : relay_in){
+                pthread_join(relays[i].thread, NULL);
+                if(!relays[i].failed && (relays[i].redir->sum != SUM_NONE || relays[i].redir->count)){
+                    reportTap(&relays[i]);
+                }
+            }
+        }
+        if(target != NULL && redir.prealloc > 0){
+            releasePrealloc(&redir);
+        }
+    }
+
+    // the pipe ends the threads used, and the files
+    closeFd(&out_pipe[0]);
+    closeFd(&out_pipe[1]);
+    closeFd(&in_pipe[0]);
+    closeFd(&in_pipe[1]);
+    closeFd(&writer.out_fd);
+    closeFd(&relays[0].out_fd);
+    closeFd(&relays[1].in_fd);
+}
+
+#define PV_CHUNK (1 << 20)      // most bytes pv moves per call
+
+// 1.5MiB style
+static void formatBytes(double bytes, char* buf, size_t len){
+    const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    int unit = 0;
+    while(bytes >= 1024 && unit < 4){
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buf, len, unit == 0 ? "%.0f%s" : "%.1f%s", bytes, units[unit]);
+}
+
+static void drawPv(struct msh_io* io, const char* name, long long bytes, double secs, int final){
+    char total[32], rate[32], line[256];
+    formatBytes(bytes, total, sizeof(total));
+    formatBytes(secs > 0 ? bytes / secs : 0, rate, sizeof(rate));
+    int elapsed = (int)secs;
+    int len = snprintf(line, sizeof(line), "\r%s%s%s %s/s %d:%02d:%02d\033[K%s", name != NULL ? name : "",
+                       name != NULL ? ": " : "", total, rate, elapsed / 3600, elapsed / 60 % 60, elapsed % 60,
+                       final ? "\n" : "");
+    if(write(io->err_fd, line, len) < 0){
+        return;     // nowhere to show it, the data still flows
+    }
+}
+
+// pv [-L RATE] [-i SECS] [-N NAME]
+// Passes its input through and shows bytes, rate and time on stderr, at most
+// every SECS (0.5). Between two pipes the data is spliced, never copied.
+// -L caps the rate (K, M, G suffixes) with a token bucket of a tenth of a second
+int builtinPv(int argc, char** argv, struct msh_io* io){
+    long long limit = 0;
+    double interval = 0.5;
+    const char* name = NULL;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-L") == 0 && i + 1 < argc && (limit = parseSize(argv[++i])) > 0){
+            continue;
+        }
+        if(strcmp(argv[i], "-i") == 0 && i + 1 < argc && (interval = atof(argv[++i])) > 0){
+            continue;
+        }
+        if(strcmp(argv[i], "-N") == 0 && i + 1 < argc){
+            name = argv[++i];
+            continue;
+        }
+        printf("Shell: Incorrect command\n");
+        return 2;
+    }
+
+    // ring buffer ends have no fd, those go through read() / write()
+    int splicing = (io->in_fd >= 0 && io->out_fd >= 0);
+    char* buf = NULL;
+    long long bytes = 0;
+    double burst = (limit > 0) ? (limit / 10.0 > 1 ? limit / 10.0 : 1) : 0;
+    double tokens = burst;
+    struct timespec start, now, drawn, refilled;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    drawn = refilled = start;
+    int status = 0;
+
+    for(;;){
+        size_t want = PV_CHUNK;
+        if(limit > 0){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            tokens += limit * secondsBetween(refilled, now);
+            refilled = now;
+            tokens = (tokens < burst) ? tokens : burst;
+            double need = (burst < PV_CHUNK) ? burst : PV_CHUNK;
+            if(tokens < need){
+                double wait = (need - tokens) / limit;
+                struct timespec nap = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+                nanosleep(&nap, NULL);
+                continue;
+            }
+            want = (tokens < PV_CHUNK) ? (size_t)tokens : PV_CHUNK;
+        }
+
+        ssize_t n;
+        if(splicing){
+            n = splice(io->in_fd, NULL, io->out_fd, NULL, want, SPLICE_F_MOVE);
+            if(n < 0 && errno == EINVAL){
+                splicing = 0;   // neither end is a pipe
+                continue;
+            }
+        }
+        else{
+            if(buf == NULL){
+                buf = malloc(PV_CHUNK);
+            }
+            n = io->read(io, buf, want);
+            if(n > 0 && io->write(io, buf, n) < 0){
+                n = -1;
+            }
+        }
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            status = (n < 0 && errno != EPIPE);
+            break;
+        }
+
+        bytes += n;
+        tokens -= n;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(secondsBetween(drawn, now) >= interval){
+            drawPv(io, name, bytes, secondsBetween(start, now), 0);
+            drawn = now;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    drawPv(io, name, bytes, secondsBetween(start, now), 1);
+    free(buf);
+    return status;
+}
+
+// Thread body for a builtin pipeline stage, closes its pipe ends when done
+// so the neighbouring stages see EOF / EPIPE just like with a process
+void* runPipeStage(void* arg){
+    struct pipeStage* stage = arg;
+    struct msh_io io = { stage->in_fd, stage->out_fd, STDERR_FILENO,
+                         stage->in_ring != NULL ? ringIoRead : fdRead,
+                         stage->out_ring != NULL ? ringIoWrite : fdWrite,
+                         envGet, envSet, stage };
+
+    stage->status = callBuiltin(stage->builtin, stage->args, &io);
+
+    if(stage->in_ring != NULL){
+        ringCloseReader(stage->in_ring);
+    }
+    else if(stage->in_fd != STDIN_FILENO){
+        close(stage->in_fd);
+    }
+    if(stage->out_ring != NULL){
+        ringCloseWriter(stage->out_ring);
+    }
+    else if(stage->out_fd != STDOUT_FILENO){
+        close(stage->out_fd);
+    }
+    return NULL;
+}
+
+// MSH_PIPESTATS: each pipe hop is split in two with a relay thread splicing
+// between them. Time it waits for input is time the reading stage was starved,
+// time it waits for room is time the writing stage was held up by the reader
+struct hopStats {
+    int in_fd;              // read end of the writing stage's pipe
+    int out_fd;             // write end of the reading stage's pipe
+    long long bytes;
+    double writer_blocked;  // reader's pipe full
+    double reader_blocked;  // writer's pipe empty
+    pthread_t thread;
+};
+
+static double waitFd(int fd, short events){
+    struct pollfd pfd = { fd, events, 0 };
+    struct timespec from, to;
+    clock_gettime(CLOCK_MONOTONIC, &from);
+    while(poll(&pfd, 1, -1) < 0 && errno == EINTR){
+        continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    return secondsBetween(from, to);
+}
+
+static void* relayHop(void* arg){
+    struct hopStats* hop = arg;
+    for(;;){
+        hop->reader_blocked += waitFd(hop->in_fd, POLLIN);
+        ssize_t n = splice(hop->in_fd, NULL, hop->out_fd, NULL, PV_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0){
+            hop->bytes += n;
+            continue;
+        }
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        // input is ready, so EAGAIN means the reader's pipe is full
+        if(n < 0 && errno == EAGAIN){
+            hop->writer_blocked += waitFd(hop->out_fd, POLLOUT);
+            continue;
+        }
+        break;      // end of input, or EPIPE once the reader exited
+    }
+    close(hop->in_fd);
+    close(hop->out_fd);
+    return NULL;
+}
+
+// Put a relay in the middle of pipe_fd, pipe_fd[0] becomes the reader's end
+static int startHop(struct hopStats* hop, int pipe_fd[2]){
+    int down[2];
+    if(pipe2(down, O_CLOEXEC) < 0){
+        return -1;
+    }
+    *hop = (struct hopStats){ pipe_fd[0], down[1], 0, 0, 0, 0 };
+    if(pthread_create(&hop->thread, NULL, relayHop, hop) != 0){
+        close(down[0]);
+        close(down[1]);
+        return -1;
+    }
+    pipe_fd[0] = down[0];
+    return 0;
+}
+
+// JSON string for the trace, command words only hold printable text
+static void bufJson(struct strBuf* buf, const char* str){
+    bufAppend(buf, "\"", 1);
+    for(; *str != '\0'; str++){
+        if(*str == '"' || *str == '\\'){
+            bufAppend(buf, "\\", 1);
+        }
+        if((unsigned char)*str >= ' '){
+            bufAppend(buf, str, 1);
+        }
+    }
+    bufAppend(buf, "\"", 1);
+}
+
+// Table on stderr, and one JSON line appended to $MSH_TRACE
+static void reportHops(char* args[][MAX_ARGS], struct hopStats* hops, int* relayed, int num_cmds, double wall){
+    struct strBuf table = { NULL, 0, 0 };
+    struct strBuf trace = { NULL, 0, 0 };
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%-4s %-24s %10s %14s %14s\n", "hop", "stages", "bytes",
+                       "writer blocked", "reader blocked");
+    bufAppend(&table, line, len);
+    len = snprintf(line, sizeof(line), "{\"wall\":%.6f,\"hops\":[", wall);
+    bufAppend(&trace, line, len);
+
+    int first = 1;
+    for(int i = 0; i < num_cmds - 1; i++){
+        if(!relayed[i]){
+            continue;   // ring buffer hop between two builtins
+        }
+        const char* from = (args[i][0] != NULL) ? args[i][0] : "-";
+        const char* to = (args[i + 1][0] != NULL) ? args[i + 1][0] : "-";
+        char stages[64], bytes[32];
+        snprintf(stages, sizeof(stages), "%s -> %s", from, to);
+        formatBytes(hops[i].bytes, bytes, sizeof(bytes));
+        len = snprintf(line, sizeof(line), "%-4d %-24s %10s %8.3fs %3.0f%% %8.3fs %3.0f%%\n", i + 1, stages, bytes,
+                       hops[i].writer_blocked, wall > 0 ? 100 * hops[i].writer_blocked / wall : 0,
+                       hops[i].reader_blocked, wall > 0 ? 100 * hops[i].reader_blocked / wall : 0);
+        bufAppend(&table, line, len);
+
+        bufAppend(&trace, first ? "{" : ",{", first ? 1 : 2);
+        len = snprintf(line, sizeof(line), "\"hop\":%d,\"from\":", i + 1);
+        bufAppend(&trace, line, len);
+        bufJson(&trace, from);
+        bufAppend(&trace, ",\"to\":", 6);
+        bufJson(&trace, to);
+        len = snprintf(line, sizeof(line), ",\"bytes\":%lld,\"writer_blocked\":%.6f,\"reader_blocked\":%.6f}",
+                       hops[i].bytes, hops[i].writer_blocked, hops[i].reader_blocked);
+        bufAppend(&trace, line, len);
+        first = 0;
+    }
+    bufAppend(&trace, "]}\n", 3);
+
+    fflush(stdout);
+    if(write(STDERR_FILENO, table.data, table.len) < 0){
+        perror("Shell: pipestats");
+    }
+    const char* path = getenv("MSH_TRACE");
+    if(path != NULL && *path != '\0'){
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(fd < 0 || write(fd, trace.data, trace.len) < 0){
+            printf("Shell: %s: %s\n", path, strerror(errno));
+        }
+        if(fd >= 0){
+            close(fd);
+        }
+    }
+    free(table.data);
+    free(trace.data);
+}
+
+// This function executes multiple commands connected by pipes
+void executePipeCommands(char* input) {
+    char* commands[MAX_PROCS];
+    int num_cmds = 0;
+
+    // Parse the input string by "|"
+    while ((commands[num_cmds] = strsep(&input, "|")) != NULL && num_cmds < MAX_PROCS) {
+        commands[num_cmds] = trimStr(commands[num_cmds]);
+        if (*commands[num_cmds] == '\0') {
+            printf("Shell: Incorrect command\n");
+            return;
+        }
+        num_cmds++;
+    }
+
+    if (num_cmds <= 1) {
+        printf("Shell: Incorrect command\n");
+        return;
+    }
+
+    int in_fd = STDIN_FILENO; // The input fd for the next command, starts with stdin
+    struct ringbuf* in_ring = NULL;
+    pid_t pids[num_cmds];
+    struct pipeStage stages[num_cmds];
+    struct ringbuf* rings[num_cmds];
+    char* args[num_cmds][MAX_ARGS];
+    struct hopStats hops[num_cmds];
+    int relayed[num_cmds];
+    int started[num_cmds];  // thread or child running, to be joined / reaped
+    int pipe_fds[num_cmds * 4];     // every pipe end made here, a forked stage drops the others
+    int num_pipe_fds = 0;
+    int failed = 0;
+    int stats = (getenv("MSH_PIPESTATS") != NULL);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Parse every stage first, the hop type depends on both of its ends
+    for (int i = 0; i < num_cmds; i++) {
+        parseInput(commands[i], args[i]);
+        pids[i] = 0;
+        rings[i] = NULL;
+        relayed[i] = 0;
+        started[i] = 0;
+        stages[i].builtin = (args[i][0] != NULL) ? lookupBuiltin(args[i][0]) : NULL;
+        if (args[i][0] != NULL && stages[i].builtin == NULL) {
+            resolveCommand(args[i][0]);
+        }
+    }
+
+    // On a failure no further stage is started, the ones already running
+    // are still joined / reaped below, after their open ends were closed
+    for (int i = 0; i < num_cmds; i++) {
+        int pipe_fd[2] = { -1, -1 };
+
+        // Two builtin threads talk through a ring buffer, no syscalls on that hop
+        if (i < num_cmds - 1 && stages[i].builtin != NULL && stages[i + 1].builtin != NULL) {
+            if ((rings[i] = ringCreate()) == NULL) {
+                failed = 1;
+                break;
+            }
+        }
+        // Create a pipe for all other hops
+        // close-on-exec so forked stages don't hold the ends owned by builtin threads
+        else if (i < num_cmds - 1) {
+            if (pipe2(pipe_fd, O_CLOEXEC) < 0) {
+                failed = 1;
+                break;
+            }
+            if (stats && startHop(&hops[i], pipe_fd) == 0) {
+                relayed[i] = 1;
+                pipe_fds[num_pipe_fds++] = hops[i].in_fd;
+                pipe_fds[num_pipe_fds++] = hops[i].out_fd;
+            }
+            pipe_fds[num_pipe_fds++] = pipe_fd[0];
+            pipe_fds[num_pipe_fds++] = pipe_fd[1];
+        }
+
+        // Builtin stages run as threads of the shell and own their pipe ends
+        if (stages[i].builtin != NULL) {
+            stages[i].args = args[i];
+            stages[i].in_fd = (in_ring != NULL) ? -1 : in_fd;
+            stages[i].in_ring = in_ring;
+            stages[i].out_ring = rings[i];
+            stages[i].out_fd = (rings[i] != NULL) ? -1 : (i < num_cmds - 1) ? pipe_fd[1] : STDOUT_FILENO;
+
+            // lastpipe: a builtin last stage runs on the shell's own thread,
+            // so `cmd | read x` sets x in the shell
+            if (i == num_cmds - 1) {
+                runPipeStage(&stages[i]);
+                started[i] = 1;
+                continue;
+            }
+            if (pthread_create(&stages[i].thread, NULL, runPipeStage, &stages[i]) != 0) {
+                closeFd(&pipe_fd[0]);
+                closeFd(&pipe_fd[1]);
+                failed = 1;
+                break;
+            }
+            started[i] = 1;
+            in_ring = rings[i];
+            if (rings[i] == NULL && i < num_cmds - 1) {
+                in_fd = pipe_fd[0];
+            }
+            continue;
+        }
+
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            closeFd(&pipe_fd[0]);
+            closeFd(&pipe_fd[1]);
+            failed = 1;
+            break;
+        }
+        started[i] = 1;
+
+        if (pids[i] == 0) { // Child Process
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+
+            // Redirect standard input if it's not the first command
+            if (in_fd != STDIN_FILENO) {
+                dup2(in_fd, STDIN_FILENO);
+                close(in_fd);
+            }
+
+            // Redirect standard output if it's not the last command
+            if (i < num_cmds - 1) {
+                dup2(pipe_fd[1], STDOUT_FILENO);
+                // Child doesn't need the pipe FDs anymore after dup2
+                close(pipe_fd[0]);
+                close(pipe_fd[1]);
+            }
+            // a function or builtin stage never execs, so close-on-exec doesn't
+            // drop the ends owned by builtin threads, its own writer's among them
+            for (int fd = 0; fd < num_pipe_fds; fd++) {
+                if (pipe_fds[fd] > STDERR_FILENO) {
+                    close(pipe_fds[fd]);
+                }
+            }
+
+            // Execute the command parsed by the parent
+            if (args[i][0] == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            execArgs(args[i]);
+        } 
+        else { // Parent Process
+            // Close the previous pipe's read end, as it's been passed to the child
+            if (in_fd != STDIN_FILENO) {
+                close(in_fd);
+            }
+
+            // For the next child, its input will be the read end of the new pipe
+            if (i < num_cmds - 1) {
+                close(pipe_fd[1]); // Parent doesn't need the write end
+                in_fd = pipe_fd[0]; // Save the read end for the next iteration
+            }
+        }
+    }
+
+    // The stage that didn't start never takes its input, so the writer
+    // before it sees EPIPE
+    if (failed) {
+        printf("Shell: Incorrect command\n");
+        if (in_ring != NULL) {
+            ringCloseReader(in_ring);
+        }
+        else if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+    }
+
+    // Wait for all child processes and builtin threads to complete, $? is the last stage's
+    for (int i = 0; i < num_cmds; i++) {
+        int status;
+        if (!started[i]) {
+            last_status = 1;
+        }
+        else if (stages[i].builtin != NULL) {
+            if (i < num_cmds - 1) {
+                pthread_join(stages[i].thread, NULL);
+            }
+            last_status = stages[i].status;
+        }
+        else if (pids[i] > 0 && waitpid(pids[i], &status, 0) > 0) {
+            last_status = statusOf(status);
+        }
+        stage_statuses[i] = last_status;
+    }
+    num_stage_statuses = num_cmds;
+    for (int i = 0; i < num_cmds; i++) {
+        if (rings[i] != NULL) {
+            ringDestroy(rings[i]);
+        }
+        if (relayed[i]) {
+            pthread_join(hops[i].thread, NULL);
+        }
+    }
+    if (stats) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        reportHops(args, hops, relayed, num_cmds, secondsBetween(start, end));
+    }
+}
+
+// Check for special operators and call the appropriate function
+void executeLine(char* line){
+    line = trimStr(line);
+    if(*line == '\0'){
+        return;
+    }
+
+    // name() { list; } defines a function
+    if(defineFunction(line)){
+        return;
+    }
+
+    // { list; } and ( list ) take precedence over the operators inside them
+    if(*line == '{' || *line == '('){
+        executeGroup(line);
+    }
+    else if(strstr(line, "|") != NULL){
+        executePipeCommands(line);
+    }
+    else if (strstr(line, "&&") != NULL) {
+        executeParallelCommands(line);
+    } 
+    else if (strstr(line, "##") != NULL) {
+        executeSequentialCommands(line);
+    } 
+    else if (strstr(line, ">") != NULL || strstr(line, "<") != NULL) {
+        executeCommandRedirection(line);
+    } 
+    else {
+        char* args[MAX_ARGS];
+        parseInput(line, args);
+        executeCommand(args); // when user wants to run a single command, builtins included
+    }
+}
+
+// Returns the bracket closing the group opened at *line, NULL if unbalanced
+static char* findGroupEnd(char* line){
+    int depth = 0;
+    for(char* p = line; *p != '\0'; p++){
+        if(*p == '{' || *p == '('){
+            depth++;
+        }
+        else if(*p == '}' || *p == ')'){
+            if(--depth == 0){
+                return (*p == (*line == '{' ? '}' : ')')) ? p : NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Whether running the list would change the shell itself (cwd, variables, builtins).
+// Looks at the first word of every command in the list
+static int listChangesState(const char* list){
+    static const char* state_builtins[] = { "cd", "read", "enable", "alias", "unalias", "pool", "coproc", NULL };
+    int command_start = 1;
+    const char* p = list;
+
+    while(*p != '\0'){
+        if(strchr(";|&#{}()", *p) != NULL){
+            command_start = 1;
+            p++;
+            continue;
+        }
+        if(isspace((unsigned char)*p)){
+            p++;
+            continue;
+        }
+
+        size_t len = strcspn(p, " \t\n;|&#{}()");
+        if(command_start){
+            // a function definition, or a call to one that might change anything
+            if(p[len] == '('){
+                return 1;
+            }
+            char name[256];
+            if(len < sizeof(name)){
+                memcpy(name, p, len);
+                name[len] = '\0';
+                if(hashGet(&functions, name) != NULL){
+                    return 1;
+                }
+            }
+            for(int i = 0; state_builtins[i] != NULL; i++){
+                if(strlen(state_builtins[i]) == len && strncmp(p, state_builtins[i], len) == 0){
+                    return 1;
+                }
+            }
+            // NAME=value assignment
+            const char* eq = memchr(p, '=', len);
+            if(eq != NULL && eq != p){
+                return 1;
+            }
+        }
+        command_start = 0;
+        p += len;
+    }
+    return 0;
+}
+
+// Split a list on top level ';' in place, nested groups kept whole.
+// Stores up to max parts, returns how many there are
+static int splitList(char* list, char** parts, int max){
+    int depth = 0;
+    int num = 0;
+    char* start = list;
+
+    for(char* p = list; ; p++){
+        if(*p == '{' || *p == '('){
+            depth++;
+        }
+        else if(*p == '}' || *p == ')'){
+            depth--;
+        }
+        else if((*p == ';' && depth == 0) || *p == '\0'){
+            int end = (*p == '\0');
+            *p = '\0';
+            start = trimStr(start);
+            if(*start != '\0'){
+                if(num < max){
+                    parts[num] = start;
+                }
+                num++;
+            }
+            if(end){
+                break;
+            }
+            start = p + 1;
+        }
+    }
+    return num;
+}
+
+// Run every ';' separated command of a group body, nested groups kept whole
+static void executeList(char* list){
+    char* copy = strdup(list);
+    int num = splitList(copy, NULL, 0);     // count on a copy, splitting is destructive
+    free(copy);
+
+    char* parts[num + 1];
+    splitList(list, parts, num);
+    for(int i = 0; i < num; i++){
+        executeLine(parts[i]);
+    }
+}
+
+// { list; } [> file]  runs in the shell, the file is opened once for the whole list
+// ( list ) [> file]   same, but forks first when the list changes shell state
+void executeGroup(char* line){
+    char* end = findGroupEnd(line);
+    if(end == NULL){
+        printf("Shell: Incorrect command\n");
+        return;
+    }
+
+    int subshell = (*line == '(');
+    char* body = line + 1;
+    char* rest = trimStr(end + 1);
+    *end = '\0';
+
+    char* filename = NULL;
+    if(*rest == '>'){
+        filename = trimStr(rest + 1);
+    }
+    if((*rest != '\0' && filename == NULL) || (filename != NULL && *filename == '\0')){
+        printf("Shell: Incorrect command\n");
+        return;
+    }
+
+    int forked = subshell && listChangesState(body);
+    if(forked){
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid < 0){
+            printf("Shell: Incorrect command\n");
+            return;
+        }
+        if(pid > 0){
+            int status;
+            waitpid(pid, &status, WUNTRACED);
+            last_status = statusOf(status);
+            return;
+        }
+    }
+
+    // point stdout at the file for the whole list, restore it afterwards
+    int saved_out = -1;
+    if(filename != NULL){
+        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+            printf("Shell: Incorrect command\n");
+            if(forked){
+                exitChild(EXIT_FAILURE);
+            }
+            return;
+        }
+        fflush(stdout);
+        saved_out = dup(STDOUT_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+
+    executeList(body);
+
+    fflush(stdout);
+    if(saved_out >= 0){
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+
+    // forked subshell is done
+    if(forked){
+        exitChild(last_status);
+    }
+}
+
+// Shell exit status of a waitpid() status, 128+n for signal n
+int statusOf(int wait_status){
+    if(WIFEXITED(wait_status)){
+        return WEXITSTATUS(wait_status);
+    }
+    if(WIFSIGNALED(wait_status)){
+        return 128 + WTERMSIG(wait_status);
+    }
+    return 128 + WSTOPSIG(wait_status);
+}
+
+static void clearCommandPaths(void){
+    for(int b = 0; b < HASH_BUCKETS; b++){
+        while(command_paths.buckets[b] != NULL){
+            free(hashRemove(&command_paths, command_paths.buckets[b]->key));
+        }
+    }
+}
+
+// Full path of a command found through PATH, cached.
+// NULL for names with a '/' and for commands that aren't found
+const char* resolveCommand(const char* name){
+    const char* path_env = getenv("PATH");
+    if(path_env == NULL || strchr(name, '/') != NULL){
+        return NULL;
+    }
+
+    // a new PATH invalidates everything looked up so far
+    if(command_paths_for == NULL || strcmp(command_paths_for, path_env) != 0){
+        clearCommandPaths();
+        free(command_paths_for);
+        command_paths_for = strdup(path_env);
+    }
+
+    const char* cached = hashGet(&command_paths, name);
+    if(cached != NULL){
+        return cached;
+    }
+
+    char* dirs = strdup(path_env);
+    char* rest = dirs;
+    char* dir;
+    char* found = NULL;
+    struct stat st;
+    while(found == NULL && (dir = strsep(&rest, ":")) != NULL){
+        char candidate[4096];
+        snprintf(candidate, sizeof(candidate), "%s/%s", *dir != '\0' ? dir : ".", name);
+        if(access(candidate, X_OK) == 0 && stat(candidate, &st) == 0 && S_ISREG(st.st_mode)){
+            found = strdup(candidate);
+        }
+    }
+    free(dirs);
+
+    if(found != NULL){
+        hashPut(&command_paths, name, found);
+    }
+    return found;
+}
+
+// Fill the PATH cache with every executable, first directory wins
+void hashAllCommands(void){
+    const char* path_env = getenv("PATH");
+    if(path_env == NULL){
+        return;
+    }
+    clearCommandPaths();
+    free(command_paths_for);
+    command_paths_for = strdup(path_env);
+
+    char* dirs = strdup(path_env);
+    char* rest = dirs;
+    char* dir;
+    while((dir = strsep(&rest, ":")) != NULL){
+        DIR* d = opendir(*dir != '\0' ? dir : ".");
+        if(d == NULL){
+            continue;
+        }
+        struct dirent* entry;
+        while((entry = readdir(d)) != NULL){
+            char candidate[4096];
+            struct stat st;
+            if(entry->d_name[0] == '.' || hashGet(&command_paths, entry->d_name) != NULL){
+                continue;
+            }
+            snprintf(candidate, sizeof(candidate), "%s/%s", *dir != '\0' ? dir : ".", entry->d_name);
+            if(access(candidate, X_OK) == 0 && stat(candidate, &st) == 0 && S_ISREG(st.st_mode)){
+                hashPut(&command_paths, entry->d_name, strdup(candidate));
+            }
+        }
+        closedir(d);
+    }
+    free(dirs);
+}
+
+// hash      lists the cached command paths
+// hash -r   forgets them
+int builtinHash(int argc, char** argv, struct msh_io* io){
+    if(argc > 1 && strcmp(argv[1], "-r") == 0){
+        clearCommandPaths();
+        return 0;
+    }
+    for(int b = 0; b < HASH_BUCKETS; b++){
+        for(struct hashEntry* entry = command_paths.buckets[b]; entry != NULL; entry = entry->next){
+            char line[4200];
+            int len = snprintf(line, sizeof(line), "%s\t%s\n", entry->key, (char*)entry->value);
+            io->write(io, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+        }
+    }
+    return 0;
+}
+
+// FNV-1a
+unsigned long hashStr(const char* str){
+    unsigned long hash = 14695981039346656037UL;
+    while(*str != '\0'){
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+void* hashGet(struct hashTable* table, const char* key){
+    struct hashEntry* entry = table->buckets[hashStr(key) % HASH_BUCKETS];
+    for(; entry != NULL; entry = entry->next){
+        if(strcmp(entry->key, key) == 0){
+            return entry->value;
+        }
+    }
+    return NULL;
+}
+
+// Insert or replace, returns the value that was replaced (NULL if new)
+void* hashPut(struct hashTable* table, const char* key, void* value){
+    struct hashEntry** bucket = &table->buckets[hashStr(key) % HASH_BUCKETS];
+    for(struct hashEntry* entry = *bucket; entry != NULL; entry = entry->next){
+        if(strcmp(entry->key, key) == 0){
+            void* old = entry->value;
+            entry->value = value;
+            return old;
+        }
+    }
+
+    struct hashEntry* entry = malloc(sizeof(struct hashEntry));
+    entry->key = strdup(key);
+    entry->value = value;
+    entry->next = *bucket;
+    *bucket = entry;
+    return NULL;
+}
+
+// Returns the removed value, NULL if the key wasn't there
+void* hashRemove(struct hashTable* table, const char* key){
+    struct hashEntry** link = &table->buckets[hashStr(key) % HASH_BUCKETS];
+    for(; *link != NULL; link = &(*link)->next){
+        struct hashEntry* entry = *link;
+        if(strcmp(entry->key, key) == 0){
+            void* value = entry->value;
+            *link = entry->next;
+            free(entry->key);
+            free(entry);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+void bufAppend(struct strBuf* buf, const char* str, size_t len){
+    if(buf->len + len + 1 > buf->cap){
+        buf->cap = (buf->len + len + 1) * 2;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+// Substitute $NAME, ${NAME}, $?, $0-$9, $# and $@ / $* (positional parameters
+// of the innermost function). Returns a malloc'd string
+char* expandVars(const char* text){
+    struct strBuf buf = { NULL, 0, 0 };
+    struct funcFrame* frame = (func_depth > 0) ? &func_frames[func_depth - 1] : NULL;
+    char num[16];
+
+    bufAppend(&buf, "", 0);
+    while(*text != '\0'){
+        const char* dollar = strchr(text, '$');
+        if(dollar == NULL){
+            bufAppend(&buf, text, strlen(text));
+            break;
+        }
+        bufAppend(&buf, text, dollar - text);
+        const char* p = dollar + 1;
+
+        if(isdigit((unsigned char)*p)){
+            int n = *p++ - '0';
+            if(frame != NULL && n < frame->argc){
+                bufAppend(&buf, frame->argv[n], strlen(frame->argv[n]));
+            }
+        }
+        else if(*p == '?'){
+            p++;
+            int len = snprintf(num, sizeof(num), "%d", last_status);
+            bufAppend(&buf, num, len);
+        }
+        else if(*p == '#'){
+            p++;
+            int len = snprintf(num, sizeof(num), "%d", frame != NULL ? frame->argc - 1 : 0);
+            bufAppend(&buf, num, len);
+        }
+        else if(*p == '@' || *p == '*'){
+            p++;
+            for(int i = 1; frame != NULL && i < frame->argc; i++){
+                if(i > 1){
+                    bufAppend(&buf, " ", 1);
+                }
+                bufAppend(&buf, frame->argv[i], strlen(frame->argv[i]));
+            }
+        }
+        else if(*p == '_' || isalpha((unsigned char)*p) || *p == '{'){
+            int braced = (*p == '{');
+            const char* name = braced ? p + 1 : p;
+            const char* end = name;
+            while(*end == '_' || isalnum((unsigned char)*end)){
+                end++;
+            }
+            if(braced && *end != '}'){
+                bufAppend(&buf, dollar, end - dollar);     // not a ${NAME}, keep as typed
+                text = end;
+                continue;
+            }
+
+            char var[256];
+            size_t len = end - name;
+            if(len < sizeof(var)){
+                memcpy(var, name, len);
+                var[len] = '\0';
+                const char* value = getenv(var);
+                if(value != NULL){
+                    bufAppend(&buf, value, strlen(value));
+                }
+            }
+            p = braced ? end + 1 : end;
+        }
+        else{
+            bufAppend(&buf, "$", 1);    // lone $
+        }
+        text = p;
+    }
+    return buf.data;
+}
+
+// name() { list; }  compiles the body and stores it, replacing an older definition.
+// Returns 0 when the line is not a function definition
+int defineFunction(char* line){
+    char* p = line;
+    while(*p == '_' || *p == '-' || isalnum((unsigned char)*p)){
+        p++;
+    }
+    size_t name_len = p - line;
+    while(isspace((unsigned char)*p)){
+        p++;
+    }
+    if(name_len == 0 || *p != '('){
+        return 0;
+    }
+    p++;
+    while(isspace((unsigned char)*p)){
+        p++;
+    }
+    if(*p != ')'){
+        return 0;
+    }
+    p++;
+    while(isspace((unsigned char)*p)){
+        p++;
+    }
+
+    char* end = (*p == '{') ? findGroupEnd(p) : NULL;
+    if(end == NULL || *trimStr(end + 1) != '\0'){
+        printf("Shell: Incorrect command\n");
+        return 1;
+    }
+
+    char name[256];
+    if(name_len >= sizeof(name)){
+        printf("Shell: Incorrect command\n");
+        return 1;
+    }
+    memcpy(name, line, name_len);
+    name[name_len] = '\0';
+
+    // split a copy of the body, the statements point into it
+    struct shellFunc* func = malloc(sizeof(struct shellFunc));
+    func->body = strndup(p + 1, end - p - 1);
+
+    char* scratch = strdup(func->body);
+    func->num_stmts = splitList(scratch, NULL, 0);
+    free(scratch);
+
+    char* stmts[func->num_stmts + 1];
+    splitList(func->body, stmts, func->num_stmts);
+    func->stmts = calloc(func->num_stmts + 1, sizeof(struct funcStmt));
+
+    for(int i = 0; i < func->num_stmts; i++){
+        struct funcStmt* stmt = &func->stmts[i];
+        stmt->expand = (strchr(stmts[i], '$') != NULL);
+
+        if(strpbrk(stmts[i], "|&#<>{}()") != NULL){
+            stmt->text = stmts[i];      // compound, dispatched on every call
+            stmt->args[0] = NULL;
+        }
+        else{
+            stmt->text = strdup(stmts[i]);
+            parseInput(stmts[i], stmt->args);
+
+            // words of an expanded alias belong to it, copy them all
+            struct strBuf words = { NULL, 0, 0 };
+            for(int j = 0; stmt->args[j] != NULL; j++){
+                bufAppend(&words, stmt->args[j], strlen(stmt->args[j]) + 1);
+            }
+            stmt->words = words.data;
+            size_t off = 0;
+            for(int j = 0; stmt->args[j] != NULL; j++){
+                stmt->args[j] = stmt->words + off;
+                off += strlen(stmt->args[j]) + 1;
+            }
+        }
+    }
+
+    struct shellFunc* old = hashPut(&functions, name, func);
+    if(old != NULL){
+        for(int i = 0; i < old->num_stmts; i++){
+            if(old->stmts[i].args[0] != NULL){
+                free(old->stmts[i].text);
+                free(old->stmts[i].words);
+            }
+        }
+        free(old->stmts);
+        free(old->body);
+        free(old);
+    }
+    return 1;
+}
+
+// Run a function in the shell with args as its positional parameters
+void callFunction(struct shellFunc* func, char** args){
+    if(func_depth == MAX_FUNC_DEPTH){
+        printf("Shell: %s: maximum function nesting exceeded\n", args[0]);
+        return;
+    }
+
+    struct funcFrame* frame = &func_frames[func_depth++];
+    frame->argv = args;
+    for(frame->argc = 0; args[frame->argc] != NULL; frame->argc++);
+
+    for(int i = 0; i < func->num_stmts; i++){
+        struct funcStmt* stmt = &func->stmts[i];
+
+        if(stmt->args[0] == NULL){
+            // compound statement, goes through the operator dispatch
+            char* line = stmt->expand ? expandVars(stmt->text) : strdup(stmt->text);
+            executeLine(line);
+            free(line);
+        }
+        else if(!stmt->expand){
+            executeCommand(stmt->args);
+        }
+        else{
+            // substitute the words holding a $, "$@" becomes one word per parameter
+            char* argv[MAX_ARGS];
+            char* owned[MAX_ARGS];
+            int argc = 0, num_owned = 0;
+
+            for(int j = 0; stmt->args[j] != NULL && argc < MAX_ARGS - 1; j++){
+                char* word = stmt->args[j];
+                if(strchr(word, '$') == NULL){
+                    argv[argc++] = word;
+                }
+                else if(strcmp(word, "$@") == 0 || strcmp(word, "$*") == 0){
+                    for(int k = 1; k < frame->argc && argc < MAX_ARGS - 1; k++){
+                        argv[argc++] = frame->argv[k];
+                    }
+                }
+                else{
+                    owned[num_owned] = expandVars(word);
+                    if(*owned[num_owned] != '\0'){
+                        argv[argc++] = owned[num_owned];
+                    }
+                    num_owned++;
+                }
+            }
+            argv[argc] = NULL;
 
-// Parse the input string and seperate cmd, tags, options, args for execvp 
-void parseInput(char* input_str, char** args){
-    int i = 0;
-    // seperates string on empty space
-    while((args[i] = strsep(&input_str, " ")) != NULL){
-        if(*args[i] != '\0'){   // token should not be a terminating char
-            i++;
+            executeCommand(argv);
+            for(int j = 0; j < num_owned; j++){
+                free(owned[j]);
+            }
         }
     }
-    // execvp needs last char to be a NULL to indicate end of args
-    args[i] = NULL;
+
+    func_depth--;
 }
 
-// Execute a single command with tags, options, args
-// Takes an array for input to execvp()
-void executeCommand(char** args){
-    if(args[0] == NULL){
+// Parse input to check for the "exit" builtin
+int isExitCommand(const char* line){
+    char* line_copy = strdup(line); // Create a copy for parsing
+    char* args[MAX_ARGS];
+    parseInput(line_copy, args);
+    int is_exit = (args[0] != NULL && strcmp(args[0], "exit") == 0);
+    free(line_copy);
+    return is_exit;
+}
+
+// Run one line of input: a function definition, or expand $ and execute it
+void runInput(char* line){
+    // function bodies keep their $ for each call
+    if(defineFunction(line)){
         return;
     }
 
-    // Fork a child, whose image will be replaced by execvp()
-    pid_t pid = fork();
+    checkStdbuf();
+    char* expanded = expandVars(line);
+    executeLine(expanded);
+    free(expanded);
+}
 
-    if(pid == -1){
-        // fork() failed
-        printf("Shell: Incorrect command\n");
-        return;
-    }
-    else if(pid == 0){
-        // child process
-        signal(SIGINT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
+// Write a whole message, returns -1 on failure
+int sendMsg(int sock, uint32_t type, const void* payload, uint32_t len){
+    struct msh_msg_hdr hdr = { MSH_PROTO_MAGIC, type, len };
+    struct iovec iov[2] = { { &hdr, sizeof(hdr) }, { (void*)payload, len } };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
 
-        if(execvp(args[0], args) < 0){
-            // if returns an error occured
-            printf("Shell: Incorrect command\n");
-            exit(EXIT_FAILURE); // child exited
+    size_t total = sizeof(hdr) + len;
+    while(total > 0){
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        total -= n;
+        // skip what was sent
+        while(msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov[0].iov_len){
+            n -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if(msg.msg_iovlen > 0){
+            msg.msg_iov[0].iov_base = (char*)msg.msg_iov[0].iov_base + n;
+            msg.msg_iov[0].iov_len -= n;
         }
     }
-    else{
-        // parent process
-        // wait(NULL);
-        int status;
-        waitpid(pid, &status, WUNTRACED);
-    }
+    return 0;
 }
 
-// Execute multiple commands with tags, options, args in parallel (limit of MAX_PROCS)
-void executeParallelCommands(char* input_str){
-    char* commands[MAX_PROCS];
-    int i = 0;
-
-    // Split commands by "&&"
-    while((commands[i] = strsep(&input_str, "&&")) != NULL && i < MAX_PROCS){
-        commands[i] = trimStr(commands[i]);
-        if(*commands[i] != '\0'){
-            i++;
+// Read exactly len bytes, 0 on a clean EOF before the first byte
+static int readFull(int fd, void* buf, size_t len){
+    size_t done = 0;
+    while(done < len){
+        ssize_t n = read(fd, (char*)buf + done, len - done);
+        if(n < 0 && errno == EINTR){
+            continue;
         }
+        if(n <= 0){
+            return (done == 0 && n == 0) ? 0 : -1;
+        }
+        done += n;
     }
+    return 1;
+}
 
-    int num = i;
-    pid_t pids[num];
+// Receive one message and the fds passed along with it.
+// payload is malloc'd and NUL terminated. Returns 0 on EOF, -1 on errors
+int recvMsg(int sock, struct msh_msg_hdr* hdr, char** payload, int* fds, int max_fds, int* num_fds){
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = { hdr, sizeof(*hdr) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
 
-    // for each process fork() a child process
-    for(i=0 ; i<num ; i++){
-        char* args[MAX_ARGS];
-        parseInput(commands[i], args);
-
-        if(args[0] != NULL){
-            pids[i] = fork(); 
-
-            if(pids[i] < 0){
-                printf("Shell: Incorrect command\n");
-                return;
-            }
-            else if(pids[i] == 0){
-                // Child Process
-                signal(SIGINT, SIG_DFL);
-                signal(SIGTSTP, SIG_DFL);
-                if(execvp(args[0], args) < 0){
-                    printf("Shell: Incorrect command\n");
-                    exit(EXIT_FAILURE);
+    *num_fds = 0;
+    ssize_t n;
+    do{
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while(n < 0 && errno == EINTR);
+    if(n <= 0){
+        return n == 0 ? 0 : -1;
+    }
+
+    // fds ride on the first bytes of the message
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(int i = 0; i < count; i++){
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if(*num_fds < max_fds){
+                    fds[(*num_fds)++] = fd;
+                }
+                else{
+                    close(fd);
                 }
             }
         }
     }
 
-    // parent must wait for all child processes to complete
-    for(i = 0 ; i<num ; i++){
-        waitpid(pids[i], NULL, 0);
+    if((size_t)n < sizeof(*hdr) && readFull(sock, (char*)hdr + n, sizeof(*hdr) - n) <= 0){
+        return -1;
+    }
+    if(hdr->magic != MSH_PROTO_MAGIC || hdr->len > MSH_MAX_PAYLOAD){
+        return -1;
+    }
+
+    *payload = malloc(hdr->len + 1);
+    if(hdr->len > 0 && readFull(sock, *payload, hdr->len) <= 0){
+        free(*payload);
+        return -1;
     }
+    (*payload)[hdr->len] = '\0';
+    return 1;
 }
 
-// Execute multiple commands with tags, options, args sequentially  (no limits specified)
-void executeSequentialCommands(char* input_str){
-    char* command;
+// Forwards a streamed job's stdout / stderr pipes to the scheduler as frames
+struct jobRelay {
+    int sock;
+    int out_fd;
+    int err_fd;
+};
 
-    // split input on "##"
-    while((command = strsep(&input_str, "##")) != NULL){
-        command = trimStr(command);
-        if(*command != '\0'){
-            char* args[MAX_ARGS];
-            parseInput(command, args);
+static void* relayJobOutput(void* arg){
+    struct jobRelay* relay = arg;
+    struct pollfd fds[2] = { { relay->out_fd, POLLIN, 0 }, { relay->err_fd, POLLIN, 0 } };
+    char* buf = malloc(LINE_BUF);
+    int open_fds = 2;
 
-            // cd being handled seperately
-            if(args[0] != NULL && strcmp(args[0], "cd") == 0){
-                if(args[1] == NULL){    // if no dir specified after cd
-                    printf("Shell: Incorrect command\n");
-                }
-                else{
-                    if(chdir(args[1]) != 0){
-                        printf("Shell: Incorrect command\n");
-                    }
-                }
+    while(open_fds > 0 && poll(fds, 2, -1) >= 0){
+        for(int i = 0; i < 2; i++){
+            if(fds[i].fd < 0 || fds[i].revents == 0){
+                continue;
             }
-            else{
-                executeCommand(args);
+            ssize_t n = read(fds[i].fd, buf, LINE_BUF);
+            if(n <= 0){
+                fds[i].fd = -1;     // poll() skips negative fds
+                open_fds--;
+                continue;
             }
+            sendMsg(relay->sock, i == 0 ? MSH_MSG_OUT : MSH_MSG_ERR, buf, n);
         }
     }
+    free(buf);
+    return NULL;
 }
 
-// Executes a single command having tags, options, args with its output redirected to a file
-void executeCommandRedirection(char* input_str){
-    char* command;
-    char* filename; 
+// Run a scheduler job with stdout / stderr on pipes relayed to the socket.
+// Runs in the session itself so the job sees the session's warm state
+static int32_t runStreamedJob(int sock, char* line){
+    int out[2], err[2];
+    if(pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0){
+        return 1;
+    }
 
-    // Split input on ">" character
-    command = strsep(&input_str, ">");
-    filename = input_str;
+    struct jobRelay relay = { sock, out[0], err[0] };
+    pthread_t thread;
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(out[1]);
+    close(err[1]);
+    pthread_create(&thread, NULL, relayJobOutput, &relay);
 
-    if(command == NULL || filename == NULL){
-        printf("Shell: Incorrect command\n");
-        return;
-    }
+    runInput(line);
+    fflush(stdout);
+    fflush(stderr);
 
-    command = trimStr(command);
-    filename = trimStr(filename);
+    // dropping the last write ends lets the relay see EOF
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+    pthread_join(thread, NULL);
+    close(out[0]);
+    close(err[0]);
+    return last_status;
+}
 
-    if(*command == '\0' || *filename == '\0'){
-        printf("Shell: Incorrect command\n");
-        return;
+// The first message must carry the daemon's token, compared in constant time
+static int checkAuth(int sock, const char* token){
+    struct msh_msg_hdr hdr;
+    char* payload;
+    int fds[3];
+    int num_fds;
+    if(recvMsg(sock, &hdr, &payload, fds, 3, &num_fds) <= 0){
+        return 0;
+    }
+    for(int i = 0; i < num_fds; i++){
+        close(fds[i]);
     }
+    size_t len = strlen(token);
+    unsigned char diff = (hdr.type != MSH_MSG_AUTH || hdr.len != len);
+    for(size_t i = 0; i < len && i < hdr.len; i++){
+        diff |= payload[i] ^ token[i];
+    }
+    free(payload);
+    return diff == 0;
+}
 
-    char* args[MAX_ARGS];
-    parseInput(command, args);
+// Send the token of $MSH_DAEMON_TOKEN, if any, as the first message of a session
+static int sendAuth(int sock){
+    const char* token = getenv("MSH_DAEMON_TOKEN");
+    if(token == NULL || *token == '\0'){
+        return 0;
+    }
+    return sendMsg(sock, MSH_MSG_AUTH, token, strlen(token));
+}
 
-    // Forking a child process
-    pid_t pid = fork();
+// One client connection, in its own forked copy of the warm daemon.
+// cd and variables carry over between the command lines of a session
+static void serveSession(int sock, const char* token){
+    struct msh_msg_hdr hdr;
+    char* payload;
+    int fds[3];
+    int num_fds;
+    int done = 0;
 
-    if(pid < 0){
-        printf("Shell: Incorrect command\n");
-        return;
+    if(token != NULL && !checkAuth(sock, token)){
+        exit(EXIT_FAILURE);
     }
-    else if(pid == 0){
-        // Child process
-        signal(SIGINT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
 
-        // open file for write only, create if it doesnt exist, and truncate it
-        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    while(!done && recvMsg(sock, &hdr, &payload, fds, 3, &num_fds) > 0){
+        if(hdr.type == MSH_MSG_JOB && num_fds == 0){
+            // scheduler job: no fds, stdin is /dev/null and output is streamed back
+            fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            fds[1] = dup(fds[0]);
+            fds[2] = dup(fds[0]);
+        }
+        else if(hdr.type != MSH_MSG_RUN || num_fds != 3){
+            for(int i = 0; i < num_fds; i++){
+                close(fds[i]);
+            }
+            free(payload);
+            break;
+        }
 
-        if(fd < 0){
-            printf("Shell: Incorrect command\n");
-            exit(EXIT_FAILURE);
+        // payload: cwd, command line, then the environment.
+        // cwd and the line must both end inside the payload
+        char* cwd = payload;
+        char* end = payload + hdr.len;
+        char* cwd_end = memchr(cwd, '\0', hdr.len);
+        char* line = (cwd_end != NULL) ? cwd_end + 1 : end;
+        if(line >= end || memchr(line, '\0', end - line) == NULL){
+            for(int i = 0; i < 3; i++){
+                close(fds[i]);
+            }
+            free(payload);
+            break;
+        }
+        clearenv();
+        for(char* env = line + strlen(line) + 1; env < end; env += strlen(env) + 1){
+            char* eq = strchr(env, '=');
+            if(eq != NULL){
+                *eq = '\0';
+                setenv(env, eq + 1, 1);
+            }
         }
 
-        // redirect standard output to file
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+        // the client's stdio becomes the session's for this command
+        fflush(stdout);
+        for(int i = 0; i < 3; i++){
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
 
-        if(execvp(args[0], args) < 0){
-            printf("Shell: Incorrect command\n");
-            exit(EXIT_FAILURE);
+        int32_t status;
+        if(chdir(cwd) != 0){
+            printf("Shell: %s: %s\n", cwd, strerror(errno));
+            status = 1;
+        }
+        else if(isExitCommand(line)){
+            status = last_status;
+            done = 1;
+        }
+        else if(hdr.type == MSH_MSG_JOB){
+            status = runStreamedJob(sock, line);
+        }
+        else{
+            runInput(line);
+            status = last_status;
+        }
+        fflush(stdout);
+        fflush(stderr);
+
+        // let go of the client's fds before reporting, so its pipes see EOF
+        int devnull = open("/dev/null", O_RDWR);
+        for(int i = 0; i < 3; i++){
+            dup2(devnull, i);
+        }
+        close(devnull);
+        free(payload);
+
+        if(sendMsg(sock, MSH_MSG_EXIT, &status, sizeof(status)) < 0){
+            break;
         }
     }
-    else{
-        int status;
-        waitpid(pid, &status, WUNTRACED);
-    }
+    exit(EXIT_SUCCESS);
 }
 
-// This function executes multiple commands connected by pipes
-void executePipeCommands(char* input) {
-    char* commands[MAX_PROCS];
-    int num_cmds = 0;
+// Open a listening or connected socket for "tcp:HOST:PORT", "unix:PATH" or a bare path.
+// Returns -1 on failure
+static int openAddr(const char* addr, int listening){
+    if(strncmp(addr, "tcp:", 4) == 0){
+        char* host = strdup(addr + 4);
+        char* port = strrchr(host, ':');
+        struct addrinfo hints = { 0 };
+        struct addrinfo* info;
+        int sock = -1;
 
-    // Parse the input string by "|"
-    while ((commands[num_cmds] = strsep(&input, "|")) != NULL && num_cmds < MAX_PROCS) {
-        commands[num_cmds] = trimStr(commands[num_cmds]);
-        if (*commands[num_cmds] == '\0') {
-            printf("Shell: Incorrect command\n");
-            return;
+        if(port == NULL){
+            port = host;        // tcp:PORT, loopback only
+            host = NULL;
         }
-        num_cmds++;
+        else{
+            *port++ = '\0';
+        }
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+        if(getaddrinfo((host == NULL && listening) ? "127.0.0.1" : host, port, &hints, &info) == 0){
+            for(struct addrinfo* ai = info; ai != NULL && sock < 0; ai = ai->ai_next){
+                sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+                if(sock < 0){
+                    continue;
+                }
+                int one = 1;
+                setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                if(listening ? (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0 || listen(sock, 64) < 0)
+                             : connect(sock, ai->ai_addr, ai->ai_addrlen) < 0){
+                    close(sock);
+                    sock = -1;
+                }
+            }
+            freeaddrinfo(info);
+        }
+        free(host != NULL ? host : port);
+        return sock;
     }
 
-    if (num_cmds <= 1) {
-        printf("Shell: Incorrect command\n");
-        return;
+    if(strncmp(addr, "unix:", 5) == 0){
+        addr += 5;
+    }
+    struct sockaddr_un un = { 0 };
+    un.sun_family = AF_UNIX;
+    if(strlen(addr) >= sizeof(un.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
     }
+    strcpy(un.sun_path, addr);
 
-    int in_fd = STDIN_FILENO; // The input fd for the next command, starts with stdin
-    pid_t pids[num_cmds];
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0){
+        return -1;
+    }
+    if(listening){
+        unlink(addr);
+    }
+    if(listening ? (bind(sock, (struct sockaddr*)&un, sizeof(un)) < 0 || listen(sock, 64) < 0)
+                 : connect(sock, (struct sockaddr*)&un, sizeof(un)) < 0){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
-    for (int i = 0; i < num_cmds; i++) {
-        int pipe_fd[2];
+int connectAddr(const char* addr){
+    int sock = openAddr(addr, 0);
+    if(sock >= 0 && sendAuth(sock) < 0){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Accept clients on a Unix socket (or tcp:HOST:PORT for remote jobs only), each gets
+// a session forked from this process so the PATH cache, functions and builtins are already warm.
+// With $MSH_DAEMON_TOKEN every session must present it first, TCP refuses to start without one
+int runDaemon(const char* addr){
+    const char* env_token = getenv("MSH_DAEMON_TOKEN");
+    char* token = (env_token != NULL && *env_token != '\0') ? strdup(env_token) : NULL;
+    if(token == NULL && strncmp(addr, "tcp:", 4) == 0){
+        printf("Shell: daemon: tcp needs MSH_DAEMON_TOKEN\n");
+        return EXIT_FAILURE;
+    }
+
+    int sock = openAddr(addr, 1);
+    if(sock < 0){
+        perror("Shell: daemon");
+        return EXIT_FAILURE;
+    }
+
+    hashAllCommands();
 
-        // Create a pipe for all but the last command
-        if (i < num_cmds - 1) {
-            if (pipe(pipe_fd) < 0) {
-                printf("Shell: Incorrect command\n");
-                return;
+    while(1){
+        int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+
+        // reap finished sessions
+        while(waitpid(-1, NULL, WNOHANG) > 0);
+
+        if(client < 0){
+            if(errno != EINTR){
+                perror("Shell: accept");
             }
+            continue;
         }
 
-        pids[i] = fork();
-        if (pids[i] < 0) {
-            printf("Shell: Incorrect command\n");
-            return;
+        pid_t pid = fork();
+        if(pid == 0){
+            close(sock);
+            serveSession(client, token);
         }
+        else if(pid < 0){
+            perror("Shell: fork");
+        }
+        close(client);
+    }
+}
 
-        if (pids[i] == 0) { // Child Process
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
+// Embedding API, see myshell.h.
+// The shell state is per process, so every context shares it and runs are serialized
+struct msh_ctx {
+    int flags;
+};
 
-            // Redirect standard input if it's not the first command
-            if (in_fd != STDIN_FILENO) {
-                dup2(in_fd, STDIN_FILENO);
-                close(in_fd);
-            }
+static pthread_mutex_t msh_lock = PTHREAD_MUTEX_INITIALIZER;
 
-            // Redirect standard output if it's not the last command
-            if (i < num_cmds - 1) {
-                dup2(pipe_fd[1], STDOUT_FILENO);
-                // Child doesn't need the pipe FDs anymore after dup2
-                close(pipe_fd[0]);
-                close(pipe_fd[1]);
-            }
+MSH_API struct msh_ctx* msh_create(int flags){
+    struct msh_ctx* ctx = malloc(sizeof(struct msh_ctx));
+    if(ctx == NULL){
+        return NULL;
+    }
+    ctx->flags = flags;
 
-            // Parse and execute the command
-            char* args[MAX_ARGS];
-            parseInput(commands[i], args);
-            if (execvp(args[0], args) < 0) {
-                printf("Shell: Incorrect command\n");
-                exit(EXIT_FAILURE);
-            }
-        } 
-        else { // Parent Process
-            // Close the previous pipe's read end, as it's been passed to the child
-            if (in_fd != STDIN_FILENO) {
-                close(in_fd);
-            }
+    // builtin stages must get EPIPE, not kill the host
+    signal(SIGPIPE, SIG_IGN);
+    return ctx;
+}
 
-            // For the next child, its input will be the read end of the new pipe
-            if (i < num_cmds - 1) {
-                close(pipe_fd[1]); // Parent doesn't need the write end
-                in_fd = pipe_fd[0]; // Save the read end for the next iteration
-            }
+MSH_API void msh_destroy(struct msh_ctx* ctx){
+    free(ctx);
+}
+
+// Point fd at an anonymous memory file, returns it (-1 on failure) and the saved original
+static int captureFd(int fd, int* saved){
+    int mem = memfd_create("msh-capture", MFD_CLOEXEC);
+    if(mem < 0){
+        return -1;
+    }
+    *saved = dup(fd);
+    dup2(mem, fd);
+    return mem;
+}
+
+// Restore fd and read everything that was written to the memory file
+static void collectFd(int fd, int saved, int mem, char** out, size_t* out_len){
+    dup2(saved, fd);
+    close(saved);
+
+    struct stat st;
+    *out_len = (fstat(mem, &st) == 0) ? st.st_size : 0;
+    *out = malloc(*out_len + 1);
+    size_t done = 0;
+    while(done < *out_len){
+        ssize_t n = pread(mem, *out + done, *out_len - done, done);
+        if(n <= 0){
+            break;
         }
+        done += n;
     }
+    *out_len = done;
+    (*out)[done] = '\0';
+    close(mem);
+}
 
-    // Wait for all child processes to complete
-    for (int i = 0; i < num_cmds; i++) {
-        waitpid(pids[i], NULL, 0);
+static void timevalSub(struct timeval* a, const struct timeval* b){
+    a->tv_sec -= b->tv_sec;
+    a->tv_usec -= b->tv_usec;
+    if(a->tv_usec < 0){
+        a->tv_sec--;
+        a->tv_usec += 1000000;
+    }
+}
+
+MSH_API int msh_run(struct msh_ctx* ctx, const char* line, struct msh_result* result){
+    int out_saved = -1, err_saved = -1;
+    int out_mem = -1, err_mem = -1;
+    struct rusage before, after;
+
+    memset(result, 0, sizeof(*result));
+    pthread_mutex_lock(&msh_lock);
+
+    fflush(stdout);
+    fflush(stderr);
+    if((ctx->flags & MSH_CAPTURE_OUT) && (out_mem = captureFd(STDOUT_FILENO, &out_saved)) < 0){
+        pthread_mutex_unlock(&msh_lock);
+        return -1;
+    }
+    if((ctx->flags & MSH_CAPTURE_ERR) && (err_mem = captureFd(STDERR_FILENO, &err_saved)) < 0){
+        if(out_mem >= 0){
+            collectFd(STDOUT_FILENO, out_saved, out_mem, &result->out, &result->out_len);
+        }
+        pthread_mutex_unlock(&msh_lock);
+        return -1;
+    }
+
+    getrusage(RUSAGE_CHILDREN, &before);
+    num_stage_statuses = 0;
+
+    char* copy = strdup(line);
+    runInput(trimStr(copy));
+    free(copy);
+
+    fflush(stdout);
+    fflush(stderr);
+    getrusage(RUSAGE_CHILDREN, &after);
+
+    if(out_mem >= 0){
+        collectFd(STDOUT_FILENO, out_saved, out_mem, &result->out, &result->out_len);
+    }
+    if(err_mem >= 0){
+        collectFd(STDERR_FILENO, err_saved, err_mem, &result->err, &result->err_len);
+    }
+
+    result->status = last_status;
+    if(num_stage_statuses == 0){
+        result->statuses[0] = last_status;
+        result->num_statuses = 1;
+    }
+    else{
+        memcpy(result->statuses, stage_statuses, num_stage_statuses * sizeof(int));
+        result->num_statuses = num_stage_statuses;
     }
+
+    // children reaped during this run, ru_maxrss stays the largest child so far
+    result->rusage = after;
+    timevalSub(&result->rusage.ru_utime, &before.ru_utime);
+    timevalSub(&result->rusage.ru_stime, &before.ru_stime);
+    result->rusage.ru_minflt -= before.ru_minflt;
+    result->rusage.ru_majflt -= before.ru_majflt;
+    result->rusage.ru_inblock -= before.ru_inblock;
+    result->rusage.ru_oublock -= before.ru_oublock;
+    result->rusage.ru_nvcsw -= before.ru_nvcsw;
+    result->rusage.ru_nivcsw -= before.ru_nivcsw;
+
+    pthread_mutex_unlock(&msh_lock);
+    return 0;
+}
+
+MSH_API void msh_result_free(struct msh_result* result){
+    free(result->out);
+    free(result->err);
+    result->out = result->err = NULL;
+    result->out_len = result->err_len = 0;
 }
 
 // Utility function to remove trailing and leading white spaces
@@ -315,7 +5496,9 @@ char* trimStr(char* input_str){
     return input_str;
 }
 
-int main(){
+// Library builds (-DMSH_LIBRARY) leave main out, see myshell.h
+#ifndef MSH_LIBRARY
+int main(int argc, char** argv){
 
     char* line = NULL;
     size_t len = 0;
@@ -325,6 +5508,12 @@ int main(){
     // Signal Handling (Ctrl+C and Ctrl+Z)
     signal(SIGINT, SIG_IGN);
     signal(SIGTSTP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);   // a builtin stage writing to a closed pipe gets EPIPE instead
+
+    // myshell --daemon /run/myshell.sock  (or tcp:HOST:PORT)
+    if(argc == 3 && strcmp(argv[1], "--daemon") == 0){
+        return runDaemon(argv[2]);
+    }
 
     // Infinite while loop - runs till exit cmd. Simulates init process
     while(1){
@@ -332,6 +5521,7 @@ int main(){
         // input prompt 'cwd$' - current working directory
         if(getcwd(cwd, sizeof(cwd)) != NULL){
             printf("%s$", cwd);
+            fflush(stdout);     // forked children must not inherit a pending prompt
         }
         else{
             perror("getcwd() error");
@@ -357,54 +5547,16 @@ int main(){
             continue;
         }
 
-        char* line_copy = strdup(line); // Create a copy for parsing
-
-        // Parse input to check for built-in commands first
-        char* args[MAX_ARGS];
-        parseInput(line_copy, args);
-        
         // Check for "exit" command
-        if (args[0] != NULL && strcmp(args[0], "exit") == 0) {
+        if (isExitCommand(line)) {
             printf("Exiting shell...\n");
-            free(line_copy);
             break;
         }
 
-        // Check for special operators and call the appropriate function
-        if(strstr(line, "|") != NULL){
-            executePipeCommands(line);
-        }
-        else if (strstr(line, "&&") != NULL) {
-            executeParallelCommands(line);
-        } 
-        else if (strstr(line, "##") != NULL) {
-            executeSequentialCommands(line);
-        } 
-        else if (strstr(line, ">") != NULL) {
-            executeCommandRedirection(line);
-        } 
-        else {
-            if (args[0] != NULL && strcmp(args[0], "cd") == 0) {
-                if (args[1] == NULL) {
-                    printf("Shell: Incorrect command\n");
-                } 
-                else {
-                    if (chdir(args[1]) != 0) {
-                        printf("Shell: Incorrect command\n"); 
-                    }
-                }
-                free(line_copy);
-                continue; 
-            }
-            else{
-                parseInput(line, args);
-                executeCommand(args); // when user wants to run a single command
-            }
-        }
-
-        free(line_copy);
+        runInput(line);
     }
 
     free(line); // free memory allocated by getline()
     return 0;
 }
+#endif
@@ -0,0 +1,202 @@
+/************
+ * Custom Bash Shell - single producer / single consumer ring buffer
+ * Connects two builtin pipeline stages running as threads of the shell.
+ * Head and tail live on their own cache lines, a write() publishes all
+ * its bytes with one store, and the futex is only touched when a side
+ * actually has to sleep.
+ */
+
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define RING_CACHE_LINE 64
+#define RING_SIZE (1 << 20)     // bytes, power of two
+#define RING_SPIN 1024          // polls before a side goes to sleep on the futex
+
+struct ringbuf {
+    // producer side
+    _Alignas(RING_CACHE_LINE) _Atomic size_t tail;
+    size_t cached_head;             // producer's last view of head
+    _Atomic uint32_t space_seq;     // producer sleeps on this
+    _Atomic int producer_waiting;
+
+    // consumer side
+    _Alignas(RING_CACHE_LINE) _Atomic size_t head;
+    size_t cached_tail;             // consumer's last view of tail
+    _Atomic uint32_t data_seq;      // consumer sleeps on this
+    _Atomic int consumer_waiting;
+
+    _Alignas(RING_CACHE_LINE) _Atomic int writer_closed;
+    _Atomic int reader_closed;
+    size_t mask;
+    char* data;
+};
+
+static inline void ringFutexWait(_Atomic uint32_t* word, uint32_t val){
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void ringFutexWake(_Atomic uint32_t* word){
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline void ringPause(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static inline struct ringbuf* ringCreate(void){
+    struct ringbuf* ring = aligned_alloc(RING_CACHE_LINE, sizeof(struct ringbuf));
+    if(ring == NULL){
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->mask = RING_SIZE - 1;
+    ring->data = malloc(RING_SIZE);
+    if(ring->data == NULL){
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+static inline void ringDestroy(struct ringbuf* ring){
+    free(ring->data);
+    free(ring);
+}
+
+// Wake the other side if it announced it is about to sleep.
+// seq_cst on both the index store and the flag load keeps this from
+// racing with the waiter's flag store / index load
+static inline void ringSignal(_Atomic int* waiting, _Atomic uint32_t* seq){
+    if(atomic_load(waiting) && atomic_exchange(waiting, 0)){
+        atomic_fetch_add(seq, 1);
+        ringFutexWake(seq);
+    }
+}
+
+// Spin, then sleep until ready() holds. ready() is re-checked after the
+// waiting flag is raised so a wake between the two cannot be lost
+#define RING_WAIT(ring, ready, waiting, seq) do{                        \
+    int spins_ = 0;                                                     \
+    while(!(ready)){                                                    \
+        if(spins_++ < RING_SPIN){                                       \
+            ringPause();                                                \
+            continue;                                                   \
+        }                                                               \
+        uint32_t seq_ = atomic_load(&(ring)->seq);                      \
+        atomic_store(&(ring)->waiting, 1);                              \
+        if(ready){                                                      \
+            atomic_store(&(ring)->waiting, 0);                          \
+            break;                                                      \
+        }                                                               \
+        ringFutexWait(&(ring)->seq, seq_);                              \
+    }                                                                   \
+} while(0)
+
+// Copy all of buf in, publishing once per contiguous chunk.
+// Returns len, or -1 with errno EPIPE once the reader has gone away
+static inline ssize_t ringWrite(struct ringbuf* ring, const void* buf, size_t len){
+    const char* src = buf;
+    size_t done = 0;
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while(done < len){
+        size_t room = RING_SIZE - (tail - ring->cached_head);
+        if(room == 0){
+            RING_WAIT(ring,
+                      (ring->cached_head = atomic_load(&ring->head)) != tail - RING_SIZE
+                          || atomic_load(&ring->reader_closed),
+                      producer_waiting, space_seq);
+            if(atomic_load(&ring->reader_closed)){
+                errno = EPIPE;
+                return -1;
+            }
+            continue;
+        }
+        if(atomic_load_explicit(&ring->reader_closed, memory_order_relaxed)){
+            errno = EPIPE;
+            return -1;
+        }
+
+        size_t off = tail & ring->mask;
+        size_t chunk = len - done;
+        if(chunk > room){
+            chunk = room;
+        }
+        if(chunk > RING_SIZE - off){
+            chunk = RING_SIZE - off;
+        }
+        memcpy(ring->data + off, src + done, chunk);
+        done += chunk;
+        tail += chunk;
+
+        // publish the whole chunk with a single store
+        atomic_store(&ring->tail, tail);
+        ringSignal(&ring->consumer_waiting, &ring->data_seq);
+    }
+    return done;
+}
+
+// Read up to len bytes, blocking until some are available.
+// Returns 0 once the writer closed and everything was consumed
+static inline ssize_t ringRead(struct ringbuf* ring, void* buf, size_t len){
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if(ring->cached_tail == head){
+        RING_WAIT(ring,
+                  (ring->cached_tail = atomic_load(&ring->tail)) != head
+                      || atomic_load(&ring->writer_closed),
+                  consumer_waiting, data_seq);
+        if(ring->cached_tail == head){
+            // the writer may have published right before closing
+            ring->cached_tail = atomic_load(&ring->tail);
+            if(ring->cached_tail == head){
+                return 0;
+            }
+        }
+    }
+
+    size_t avail = ring->cached_tail - head;
+    size_t off = head & ring->mask;
+    size_t chunk = len < avail ? len : avail;
+    if(chunk > RING_SIZE - off){
+        chunk = RING_SIZE - off;
+    }
+    memcpy(buf, ring->data + off, chunk);
+
+    atomic_store(&ring->head, head + chunk);
+    ringSignal(&ring->producer_waiting, &ring->space_seq);
+    return chunk;
+}
+
+// Producer is done, the consumer drains what is left and then sees EOF
+static inline void ringCloseWriter(struct ringbuf* ring){
+    atomic_store(&ring->writer_closed, 1);
+    atomic_store(&ring->consumer_waiting, 0);
+    atomic_fetch_add(&ring->data_seq, 1);
+    ringFutexWake(&ring->data_seq);
+}
+
+// Consumer is done, further writes fail with EPIPE
+static inline void ringCloseReader(struct ringbuf* ring){
+    atomic_store(&ring->reader_closed, 1);
+    atomic_store(&ring->producer_waiting, 0);
+    atomic_fetch_add(&ring->space_seq, 1);
+    ringFutexWake(&ring->space_seq);
+}
+
+#endif